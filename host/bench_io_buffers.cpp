@@ -0,0 +1,179 @@
+/*
+MIT License
+
+Copyright (c) 2025 Adam Sawicki, https://asawicki.info
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "../src/precompiled_header.hpp"
+#include "../src/utils.hpp"
+#include "../src/checksum.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+/*
+Sweep of entry data buffer sizes, for the host build described in README. A file is
+copied through ReadAheadFile and WriteBehindFile, as stored data is when packing
+and extracting, with fixed buffer sizes and with the adaptive size chosen by
+IoBufferSizer. Optionally, every read and write request is delayed by the host
+shim, like on a network share, where the larger buffers pay off.
+
+Usage: bench_io_buffers [work_dir] [file_size_mb] [latency_us...]
+Defaults: /tmp, 64 MB, latencies 0 and 300 us.
+*/
+
+// Same as in archive.cpp.
+static const size_t kBufSize = 0x10000; // 64 KB
+static const size_t kMaxIoBufferMemory = 0x4000000; // 64 MB
+static const uint32_t kPackPipelineThreadCount = 3;
+static const size_t kReadAheadChunkCount = 16;
+static const size_t kMaxPendingWrites = 16;
+
+static const size_t kFixedBufferSizes[] = { 0x10000, 0x40000, 0x100000, 0x400000 };
+static const int kRunCount = 3;
+
+// Buffers in flight when packing, as counted by PackFilesW for its cap.
+static const size_t kPackBufferCount = 2 * (kReadAheadChunkCount + 1) + kMaxPendingWrites + 1;
+
+// Returns the largest power of 2 buffer size, at least kBufSize, such that
+// buffer_count buffers fit in kMaxIoBufferMemory, like archive.cpp.
+static size_t CalcMaxIoBufferSize(size_t buffer_count)
+{
+    size_t size = kBufSize;
+    while(size * 2 * buffer_count <= kMaxIoBufferMemory)
+        size *= 2;
+    return size;
+}
+
+// Copies src_path to dst_path like stored data is copied. Returns seconds taken.
+static double CopyFile(const std::string& src_path, const std::string& dst_path, uint64_t size,
+    IoBufferSizer& sizer)
+{
+    ThreadPool thread_pool(kPackPipelineThreadCount);
+    BufferPool buffer_pool;
+    const auto begin_time = std::chrono::steady_clock::now();
+    UniqueFilePtr dst_file(fopen(dst_path.c_str(), "wb"));
+    if(!dst_file)
+        throw E_ECREATE;
+    {
+        UniqueFilePtr src_file(fopen(src_path.c_str(), "rb"));
+        if(!src_file)
+            throw E_EOPEN;
+        ReadAheadFile src(std::move(src_file), size, &thread_pool, buffer_pool, sizer, kReadAheadChunkCount);
+        WriteBehindFile dst(dst_file.get(), &thread_pool, buffer_pool, sizer, kMaxPendingWrites);
+        uint32_t crc32 = 0;
+        for(std::span<const char> data = src.Peek(); !data.empty(); data = src.Peek())
+        {
+            crc32 = Crc32(crc32, data.data(), data.size());
+            std::vector<char> buffer = buffer_pool.Acquire(data.size());
+            memcpy(buffer.data(), data.data(), data.size());
+            dst.Write(std::move(buffer));
+            src.Skip(data.size());
+        }
+        dst.Finish();
+    }
+    dst_file.reset();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin_time).count();
+}
+
+static std::string FormatSize(size_t size)
+{
+    return size >= 0x100000 ? std::to_string(size >> 20) + " MB" : std::to_string(size >> 10) + " KB";
+}
+
+int main(int argc, char** argv)
+{
+    const std::string work_dir = argc > 1 ? argv[1] : "/tmp";
+    const uint64_t file_size = (argc > 2 ? (uint64_t)atoll(argv[2]) : 64) << 20;
+    std::vector<uint32_t> latencies_us;
+    for(int i = 3; i < argc; ++i)
+        latencies_us.push_back((uint32_t)atoi(argv[i]));
+    if(latencies_us.empty())
+        latencies_us = { 0, 300 };
+    if(file_size == 0)
+    {
+        fprintf(stderr, "Usage: bench_io_buffers [work_dir] [file_size_mb] [latency_us...]\n");
+        return 2;
+    }
+
+    // Incompressible, so it would be stored.
+    const std::string src_path = work_dir + "/bench_io_buffers.src";
+    const std::string dst_path = work_dir + "/bench_io_buffers.dst";
+    {
+        UniqueFilePtr src_file(fopen(src_path.c_str(), "wb"));
+        if(!src_file)
+        {
+            fprintf(stderr, "Cannot create %s\n", src_path.c_str());
+            return 1;
+        }
+        std::mt19937_64 rng(1);
+        std::vector<uint64_t> block(kBufSize / sizeof(uint64_t));
+        for(uint64_t offset = 0; offset < file_size; offset += kBufSize)
+        {
+            for(uint64_t& value : block)
+                value = rng();
+            fwrite(block.data(), 1, (size_t)std::min<uint64_t>(kBufSize, file_size - offset), src_file.get());
+        }
+    }
+
+    const size_t max_adaptive_size = CalcMaxIoBufferSize(kPackBufferCount);
+    printf("Copy of %llu MB, best of %d runs. Adaptive size is from %s to %s.\n",
+        (unsigned long long)(file_size >> 20), kRunCount, FormatSize(kBufSize).c_str(),
+        FormatSize(max_adaptive_size).c_str());
+    printf("latency_us  buffer    ms       MB/s    final buffer\n");
+    try
+    {
+        for(uint32_t latency_us : latencies_us)
+        {
+            host::g_io_latency_us = latency_us;
+            // Fixed sizes, then 0 for adaptive.
+            std::vector<size_t> sizes(std::begin(kFixedBufferSizes), std::end(kFixedBufferSizes));
+            sizes.push_back(0);
+            for(size_t size : sizes)
+            {
+                double best_seconds = 0.0;
+                size_t final_size = 0;
+                for(int run = 0; run < kRunCount; ++run)
+                {
+                    IoBufferSizer sizer(size ? size : kBufSize, size ? size : max_adaptive_size);
+                    const double seconds = CopyFile(src_path, dst_path, file_size, sizer);
+                    if(run == 0 || seconds < best_seconds)
+                        best_seconds = seconds;
+                    final_size = sizer.GetBufferSize(UINT64_MAX);
+                }
+                printf("%-10u  %-8s  %-7.1f  %-6.0f  %s\n", latency_us,
+                    size ? FormatSize(size).c_str() : "adaptive", best_seconds * 1000.0,
+                    (double)file_size / best_seconds / 1e6, FormatSize(final_size).c_str());
+                fflush(stdout);
+            }
+        }
+    }
+    catch(int error_code)
+    {
+        fprintf(stderr, "Copy failed with error %d\n", error_code);
+        remove(src_path.c_str());
+        remove(dst_path.c_str());
+        return 1;
+    }
+    remove(src_path.c_str());
+    remove(dst_path.c_str());
+    return 0;
+}
@@ -0,0 +1,157 @@
+/*
+MIT License
+
+Copyright (c) 2025 Adam Sawicki, https://asawicki.info
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "../src/precompiled_header.hpp"
+#include "../src/utils.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+/*
+Microbenchmark of matching entry paths against a delete list, for the host build
+described in README. PathSet::ContainsPathOrParent, used by DeleteFilesW, is compared
+with the previous matcher, which upper-cased every entry path and searched each of its
+ancestors in the sorted, upper-cased delete list. Both must select the same entries.
+
+Usage: bench_path_set [entry_count] [pattern_count]
+*/
+
+static const size_t kDefaultEntryCount = 1000000;
+static const size_t kDefaultPatternCount = 100000;
+static const uint32_t kMaxDepth = 5;
+
+static void UpperCase(std::wstring& inout)
+{
+    for(wchar_t& ch : inout)
+        ch = (wchar_t)towupper(ch);
+}
+
+// Matcher used by DeleteFilesW before PathSet.
+static bool ShouldDeleteSorted(const wstr_view& curr_path, std::span<const std::wstring> paths_to_delete)
+{
+    auto final_curr_path = curr_path.to_string();
+    UpperCase(final_curr_path);
+
+    while(!final_curr_path.empty())
+    {
+        const auto it = std::lower_bound(
+            paths_to_delete.begin(), paths_to_delete.end(), final_curr_path);
+        if(it != paths_to_delete.end() && *it == final_curr_path)
+            return true;
+        UpDir(final_curr_path);
+    }
+
+    return false;
+}
+
+// Paths of files 1 to kMaxDepth directories deep, in few top-level directories.
+static std::vector<std::wstring> MakeEntryPaths(size_t count, std::mt19937& rng)
+{
+    std::vector<std::wstring> paths;
+    paths.reserve(count);
+    for(size_t i = 0; i < count; ++i)
+    {
+        std::wstring path;
+        const uint32_t depth = 1 + rng() % kMaxDepth;
+        for(uint32_t level = 0; level < depth; ++level)
+            path += L"Dir" + std::to_wstring(rng() % (level == 0 ? 50 : 20)) + L"\\";
+        path += L"File" + std::to_wstring(i) + L".txt";
+        paths.push_back(std::move(path));
+    }
+    return paths;
+}
+
+// Mostly files, 10% directories and 10% paths that match nothing, half of them upper-cased.
+static std::vector<std::wstring> MakePatterns(size_t count, std::span<const std::wstring> entry_paths,
+    std::mt19937& rng)
+{
+    std::vector<std::wstring> patterns;
+    patterns.reserve(count);
+    for(size_t i = 0; i < count; ++i)
+    {
+        std::wstring pattern = entry_paths[rng() % entry_paths.size()];
+        const uint32_t kind = rng() % 10;
+        if(kind == 0)
+        {
+            // Directory deep enough not to delete a large part of the archive.
+            if(std::count(pattern.begin(), pattern.end(), L'\\') >= 4)
+                UpDir(pattern);
+        }
+        else if(kind == 1)
+            pattern += L"x";
+        if(rng() % 2)
+            UpperCase(pattern);
+        patterns.push_back(std::move(pattern));
+    }
+    return patterns;
+}
+
+int main(int argc, char** argv)
+{
+    const size_t entry_count = argc > 1 ? (size_t)atoll(argv[1]) : kDefaultEntryCount;
+    const size_t pattern_count = argc > 2 ? (size_t)atoll(argv[2]) : kDefaultPatternCount;
+    if(entry_count == 0)
+    {
+        fprintf(stderr, "Usage: bench_path_set [entry_count] [pattern_count]\n");
+        return 2;
+    }
+
+    std::mt19937 rng(1);
+    const std::vector<std::wstring> entry_paths = MakeEntryPaths(entry_count, rng);
+    const std::vector<std::wstring> patterns = MakePatterns(pattern_count, entry_paths, rng);
+
+    using Clock = std::chrono::steady_clock;
+    auto to_ms = [](Clock::duration duration)
+    {
+        return std::chrono::duration<double, std::milli>(duration).count();
+    };
+
+    // Preparing the delete list is part of both measurements.
+    const auto sorted_begin_time = Clock::now();
+    std::vector<std::wstring> sorted_patterns = patterns;
+    for(std::wstring& pattern : sorted_patterns)
+        UpperCase(pattern);
+    std::sort(sorted_patterns.begin(), sorted_patterns.end());
+    size_t sorted_match_count = 0;
+    for(const std::wstring& path : entry_paths)
+        sorted_match_count += ShouldDeleteSorted(path, sorted_patterns) ? 1 : 0;
+    const double sorted_ms = to_ms(Clock::now() - sorted_begin_time);
+
+    const auto set_begin_time = Clock::now();
+    const PathSet path_set(patterns);
+    size_t set_match_count = 0;
+    for(const std::wstring& path : entry_paths)
+        set_match_count += path_set.ContainsPathOrParent(path) ? 1 : 0;
+    const double set_ms = to_ms(Clock::now() - set_begin_time);
+
+    printf("%zu entries, %zu patterns\n", entry_count, pattern_count);
+    printf("sorted list: %zu matches, %.1f ms\n", sorted_match_count, sorted_ms);
+    printf("PathSet:     %zu matches, %.1f ms\n", set_match_count, set_ms);
+    if(sorted_match_count != set_match_count)
+    {
+        fprintf(stderr, "Matchers selected different entries.\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,475 @@
+/*
+MIT License
+
+Copyright (c) 2025 Adam Sawicki, https://asawicki.info
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+/*
+Subset of Win32 API and Microsoft CRT used by the plugin, implemented with POSIX
+for the host build described in README. Files are opened as file descriptors, which
+are used as HANDLE values. File mapping is done with mmap. Paths are converted to
+the multibyte encoding of the current locale, with backslashes changed to slashes.
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cwchar>
+#include <cwctype>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define __stdcall
+#define __declspec(x)
+
+typedef void* HANDLE;
+typedef uint32_t DWORD;
+typedef int BOOL;
+typedef uint16_t WORD;
+typedef wchar_t WCHAR;
+typedef uintptr_t UINT_PTR;
+typedef int64_t LONGLONG;
+typedef int errno_t;
+
+#define TRUE 1
+#define FALSE 0
+#define MAX_PATH 260
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+
+#define FILE_ATTRIBUTE_READONLY 0x1
+#define FILE_ATTRIBUTE_HIDDEN 0x2
+#define FILE_ATTRIBUTE_SYSTEM 0x4
+#define FILE_ATTRIBUTE_DIRECTORY 0x10
+#define FILE_ATTRIBUTE_ARCHIVE 0x20
+#define FILE_ATTRIBUTE_NORMAL 0x80
+
+#define GENERIC_READ 0x80000000u
+#define GENERIC_WRITE 0x40000000u
+#define FILE_SHARE_READ 0x1
+#define FILE_SHARE_WRITE 0x2
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+#define PAGE_READONLY 0x2
+#define FILE_MAP_READ 0x4
+#define MOVEFILE_REPLACE_EXISTING 0x1
+#define MOVEFILE_WRITE_THROUGH 0x8
+#define CP_ACP 0
+
+#define ZeroMemory(dst, size) memset((dst), 0, (size))
+
+struct FILETIME
+{
+    DWORD dwLowDateTime;
+    DWORD dwHighDateTime;
+};
+
+union LARGE_INTEGER
+{
+    struct
+    {
+        DWORD LowPart;
+        int32_t HighPart;
+    };
+    LONGLONG QuadPart;
+};
+
+struct WIN32_FILE_ATTRIBUTE_DATA
+{
+    DWORD dwFileAttributes;
+    FILETIME ftCreationTime;
+    FILETIME ftLastAccessTime;
+    FILETIME ftLastWriteTime;
+    DWORD nFileSizeHigh;
+    DWORD nFileSizeLow;
+};
+
+enum GET_FILEEX_INFO_LEVELS { GetFileExInfoStandard };
+
+enum FILE_INFO_BY_HANDLE_CLASS { FileAllocationInfo = 5 };
+
+struct FILE_ALLOCATION_INFO
+{
+    LARGE_INTEGER AllocationSize;
+};
+
+namespace host
+{
+
+// Number of 100-nanosecond FILETIME intervals between 1601-01-01 and 1970-01-01.
+static const uint64_t kUnixEpochFileTime = 116444736000000000ull;
+static const uint64_t kFileTimeTicksPerSecond = 10000000;
+
+inline std::string ToNativePath(const wchar_t* path)
+{
+    std::string result;
+    char buf[MB_LEN_MAX];
+    mbstate_t state = {};
+    for(; *path; ++path)
+    {
+        const wchar_t ch = *path == L'\\' ? L'/' : *path;
+        const size_t len = wcrtomb(buf, ch, &state);
+        if(len == (size_t)-1)
+            result += '?';
+        else
+            result.append(buf, len);
+    }
+    return result;
+}
+
+inline int ToFd(HANDLE handle) { return (int)(intptr_t)handle; }
+inline HANDLE ToHandle(int fd) { return (HANDLE)(intptr_t)fd; }
+
+inline uint64_t ToUint64(const FILETIME& file_time)
+{
+    return ((uint64_t)file_time.dwHighDateTime << 32) | file_time.dwLowDateTime;
+}
+inline FILETIME ToFileTime(uint64_t ticks)
+{
+    return FILETIME{ (DWORD)ticks, (DWORD)(ticks >> 32) };
+}
+inline FILETIME ToFileTime(const timespec& ts)
+{
+    return ToFileTime(kUnixEpochFileTime + (uint64_t)ts.tv_sec * kFileTimeTicksPerSecond +
+        (uint64_t)ts.tv_nsec / 100);
+}
+inline timespec ToTimespec(const FILETIME& file_time)
+{
+    const uint64_t ticks = ToUint64(file_time) - kUnixEpochFileTime;
+    return timespec{ (time_t)(ticks / kFileTimeTicksPerSecond),
+        (long)(ticks % kFileTimeTicksPerSecond * 100) };
+}
+
+// Like Windows, uses the current time zone offset, not the one at the converted time.
+inline int64_t GetLocalTimeOffsetTicks()
+{
+    const time_t now = time(nullptr);
+    tm local_tm;
+    localtime_r(&now, &local_tm);
+    return (int64_t)local_tm.tm_gmtoff * (int64_t)kFileTimeTicksPerSecond;
+}
+
+// When set, MapViewOfFile fails, so the plugin falls back to reading through FILE*.
+inline bool g_disable_mapping = false;
+
+// Delay added to every fread and fwrite of the plugin, to simulate latency of requests
+// to a network share in benchmarks.
+inline std::atomic<uint32_t> g_io_latency_us{0};
+
+// Sizes of views returned by MapViewOfFile, needed by munmap.
+inline std::mutex g_view_mutex;
+inline std::map<const void*, size_t> g_view_sizes;
+
+} // namespace host
+
+inline uint64_t GetTickCount64()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+inline void GetSystemTimeAsFileTime(FILETIME* file_time)
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    *file_time = host::ToFileTime(ts);
+}
+
+inline BOOL FileTimeToLocalFileTime(const FILETIME* file_time, FILETIME* local_file_time)
+{
+    *local_file_time = host::ToFileTime(host::ToUint64(*file_time) + host::GetLocalTimeOffsetTicks());
+    return TRUE;
+}
+
+inline BOOL LocalFileTimeToFileTime(const FILETIME* local_file_time, FILETIME* file_time)
+{
+    *file_time = host::ToFileTime(host::ToUint64(*local_file_time) - host::GetLocalTimeOffsetTicks());
+    return TRUE;
+}
+
+inline BOOL FileTimeToDosDateTime(const FILETIME* file_time, WORD* dos_date, WORD* dos_time)
+{
+    const time_t t = host::ToTimespec(*file_time).tv_sec;
+    tm tm_value;
+    if(!gmtime_r(&t, &tm_value) || tm_value.tm_year < 80 || tm_value.tm_year > 207)
+        return FALSE;
+    *dos_date = (WORD)(((tm_value.tm_year - 80) << 9) | ((tm_value.tm_mon + 1) << 5) | tm_value.tm_mday);
+    *dos_time = (WORD)((tm_value.tm_hour << 11) | (tm_value.tm_min << 5) | (tm_value.tm_sec / 2));
+    return TRUE;
+}
+
+inline BOOL DosDateTimeToFileTime(WORD dos_date, WORD dos_time, FILETIME* file_time)
+{
+    tm tm_value = {};
+    tm_value.tm_year = (dos_date >> 9) + 80;
+    tm_value.tm_mon = ((dos_date >> 5) & 0xF) - 1;
+    tm_value.tm_mday = dos_date & 0x1F;
+    tm_value.tm_hour = dos_time >> 11;
+    tm_value.tm_min = (dos_time >> 5) & 0x3F;
+    tm_value.tm_sec = (dos_time & 0x1F) * 2;
+    if(tm_value.tm_mon < 0 || tm_value.tm_mon > 11 || tm_value.tm_mday == 0)
+        return FALSE;
+    *file_time = host::ToFileTime(timespec{ timegm(&tm_value), 0 });
+    return TRUE;
+}
+
+inline BOOL GetFileAttributesExW(const wchar_t* path, GET_FILEEX_INFO_LEVELS, WIN32_FILE_ATTRIBUTE_DATA* data)
+{
+    struct stat st;
+    if(stat(host::ToNativePath(path).c_str(), &st) != 0)
+        return FALSE;
+    *data = {};
+    data->dwFileAttributes = S_ISDIR(st.st_mode) ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_ARCHIVE;
+    if((st.st_mode & S_IWUSR) == 0)
+        data->dwFileAttributes |= FILE_ATTRIBUTE_READONLY;
+    data->ftCreationTime = host::ToFileTime(st.st_ctim);
+    data->ftLastAccessTime = host::ToFileTime(st.st_atim);
+    data->ftLastWriteTime = host::ToFileTime(st.st_mtim);
+    data->nFileSizeLow = (DWORD)st.st_size;
+    data->nFileSizeHigh = (DWORD)((uint64_t)st.st_size >> 32);
+    return TRUE;
+}
+
+// Only FILE_ATTRIBUTE_READONLY is applied, as removal of write permission.
+inline BOOL SetFileAttributesW(const wchar_t* path, DWORD attributes)
+{
+    if((attributes & FILE_ATTRIBUTE_READONLY) == 0)
+        return TRUE;
+    const std::string native_path = host::ToNativePath(path);
+    struct stat st;
+    if(stat(native_path.c_str(), &st) != 0)
+        return FALSE;
+    return chmod(native_path.c_str(), st.st_mode & ~(mode_t)(S_IWUSR | S_IWGRP | S_IWOTH)) == 0;
+}
+#define SetFileAttributes SetFileAttributesW
+
+inline BOOL CreateDirectoryW(const wchar_t* path, void*)
+{
+    return mkdir(host::ToNativePath(path).c_str(), 0777) == 0;
+}
+
+inline BOOL RemoveDirectoryW(const wchar_t* path)
+{
+    return rmdir(host::ToNativePath(path).c_str()) == 0;
+}
+
+inline BOOL DeleteFileW(const wchar_t* path)
+{
+    return unlink(host::ToNativePath(path).c_str()) == 0;
+}
+
+inline BOOL MoveFileExW(const wchar_t* existing_path, const wchar_t* new_path, DWORD flags)
+{
+    const std::string native_existing_path = host::ToNativePath(existing_path);
+    if(flags & MOVEFILE_WRITE_THROUGH)
+    {
+        const int fd = open(native_existing_path.c_str(), O_RDONLY);
+        if(fd >= 0)
+        {
+            fsync(fd);
+            close(fd);
+        }
+    }
+    // rename always replaces an existing file.
+    return rename(native_existing_path.c_str(), host::ToNativePath(new_path).c_str()) == 0;
+}
+
+inline HANDLE CreateFileW(const wchar_t* path, DWORD desired_access, DWORD, void*,
+    DWORD creation_disposition, DWORD, HANDLE)
+{
+    int flags = (desired_access & GENERIC_WRITE) ? O_RDWR : O_RDONLY;
+    if(creation_disposition == CREATE_ALWAYS)
+        flags |= O_CREAT | O_TRUNC;
+    const int fd = open(host::ToNativePath(path).c_str(), flags | O_CLOEXEC, 0666);
+    return fd < 0 ? INVALID_HANDLE_VALUE : host::ToHandle(fd);
+}
+
+inline BOOL CloseHandle(HANDLE handle)
+{
+    return close(host::ToFd(handle)) == 0;
+}
+
+inline BOOL GetFileSizeEx(HANDLE file, LARGE_INTEGER* file_size)
+{
+    struct stat st;
+    if(fstat(host::ToFd(file), &st) != 0)
+        return FALSE;
+    file_size->QuadPart = st.st_size;
+    return TRUE;
+}
+
+inline BOOL SetFileTime(HANDLE file, const FILETIME*, const FILETIME* last_access_time,
+    const FILETIME* last_write_time)
+{
+    timespec times[2] = { { 0, UTIME_OMIT }, { 0, UTIME_OMIT } };
+    if(last_access_time)
+        times[0] = host::ToTimespec(*last_access_time);
+    if(last_write_time)
+        times[1] = host::ToTimespec(*last_write_time);
+    return futimens(host::ToFd(file), times) == 0;
+}
+
+// Reserves space without changing file size, like FileAllocationInfo on Windows.
+inline BOOL SetFileInformationByHandle(HANDLE file, FILE_INFO_BY_HANDLE_CLASS info_class,
+    void* info, DWORD)
+{
+#if defined(__linux__)
+    if(info_class != FileAllocationInfo)
+        return FALSE;
+    const LONGLONG size = ((const FILE_ALLOCATION_INFO*)info)->AllocationSize.QuadPart;
+    return fallocate(host::ToFd(file), FALLOC_FL_KEEP_SIZE, 0, (off_t)size) == 0;
+#else
+    return FALSE;
+#endif
+}
+
+// Mapping object is a duplicate of the file descriptor, so it can be closed independently.
+inline HANDLE CreateFileMappingW(HANDLE file, void*, DWORD, DWORD, DWORD, const wchar_t*)
+{
+    const int fd = fcntl(host::ToFd(file), F_DUPFD_CLOEXEC, 0);
+    return fd < 0 ? nullptr : host::ToHandle(fd);
+}
+
+// Maps the whole file. Only read-only views of whole files are supported.
+inline void* MapViewOfFile(HANDLE mapping, DWORD, DWORD, DWORD, size_t)
+{
+    if(host::g_disable_mapping)
+        return nullptr;
+    struct stat st;
+    if(fstat(host::ToFd(mapping), &st) != 0 || st.st_size == 0)
+        return nullptr;
+    void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, host::ToFd(mapping), 0);
+    if(data == MAP_FAILED)
+        return nullptr;
+    std::lock_guard<std::mutex> lock(host::g_view_mutex);
+    host::g_view_sizes[data] = (size_t)st.st_size;
+    return data;
+}
+
+inline BOOL UnmapViewOfFile(const void* data)
+{
+    size_t size;
+    {
+        std::lock_guard<std::mutex> lock(host::g_view_mutex);
+        auto it = host::g_view_sizes.find(data);
+        if(it == host::g_view_sizes.end())
+            return FALSE;
+        size = it->second;
+        host::g_view_sizes.erase(it);
+    }
+    return munmap(const_cast<void*>(data), size) == 0;
+}
+
+// Converts from the multibyte encoding of the current locale.
+inline int MultiByteToWideChar(unsigned, DWORD, const char* src, int src_size, wchar_t* dst, int dst_size)
+{
+    if(src_size != -1)
+        return 0;
+    const size_t len = mbstowcs(dst, src, (size_t)dst_size);
+    if(len == (size_t)-1 || len >= (size_t)dst_size)
+        return 0;
+    return (int)len + 1;
+}
+
+// Microsoft CRT
+
+inline errno_t _wfopen_s(FILE** file, const wchar_t* path, const wchar_t* mode)
+{
+    std::string native_mode;
+    for(; *mode; ++mode)
+        native_mode += (char)*mode;
+    *file = fopen(host::ToNativePath(path).c_str(), native_mode.c_str());
+    return *file ? 0 : errno;
+}
+
+inline int _fseeki64(FILE* file, int64_t offset, int origin) { return fseeko(file, (off_t)offset, origin); }
+inline int64_t _ftelli64(FILE* file) { return ftello(file); }
+inline int _fileno(FILE* file) { return fileno(file); }
+
+inline int _wcsicmp(const wchar_t* lhs, const wchar_t* rhs) { return wcscasecmp(lhs, rhs); }
+inline int _wcsnicmp(const wchar_t* lhs, const wchar_t* rhs, size_t count) { return wcsncasecmp(lhs, rhs, count); }
+
+inline int _strnicmp(const char* lhs, const char* rhs, size_t count) { return strncasecmp(lhs, rhs, count); }
+
+inline errno_t strcpy_s(char* dst, size_t dst_size, const char* src)
+{
+    if(strlen(src) >= dst_size)
+    {
+        dst[0] = '\0';
+        return ERANGE;
+    }
+    strcpy(dst, src);
+    return 0;
+}
+
+inline errno_t wcscpy_s(wchar_t* dst, size_t dst_size, const wchar_t* src)
+{
+    if(wcslen(src) >= dst_size)
+    {
+        dst[0] = L'\0';
+        return ERANGE;
+    }
+    wcscpy(dst, src);
+    return 0;
+}
+
+template<size_t Size>
+inline errno_t wcscpy_s(wchar_t (&dst)[Size], const wchar_t* src)
+{
+    return wcscpy_s(dst, Size, src);
+}
+
+namespace host
+{
+
+inline size_t DelayedFread(void* buf, size_t elem_size, size_t elem_count, FILE* file)
+{
+    if(const uint32_t latency_us = g_io_latency_us)
+        usleep(latency_us);
+    return fread(buf, elem_size, elem_count, file);
+}
+
+inline size_t DelayedFwrite(const void* buf, size_t elem_size, size_t elem_count, FILE* file)
+{
+    if(const uint32_t latency_us = g_io_latency_us)
+        usleep(latency_us);
+    return fwrite(buf, elem_size, elem_count, file);
+}
+
+} // namespace host
+
+// Defined last, so only code including this file calls them.
+#define fread(buf, elem_size, elem_count, file) host::DelayedFread(buf, elem_size, elem_count, file)
+#define fwrite(buf, elem_size, elem_count, file) host::DelayedFwrite(buf, elem_size, elem_count, file)
@@ -0,0 +1,45 @@
+/*
+MIT License
+
+Copyright (c) 2025 Adam Sawicki, https://asawicki.info
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+// Compiler intrinsics of MSVC for the host build.
+
+#if defined(__x86_64__)
+
+// Enables the PCLMULQDQ path of Crc32, which is chosen at run time by CPUID.
+#define _M_X64 1
+#pragma GCC target("pclmul,sse4.1")
+
+#include <x86intrin.h>
+#include <cpuid.h>
+
+// cpuid.h defines __cpuid as a macro with other parameters.
+#undef __cpuid
+
+inline void __cpuid(int info[4], int function_id)
+{
+    __cpuid_count(function_id, 0, info[0], info[1], info[2], info[3]);
+}
+
+#endif
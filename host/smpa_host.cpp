@@ -0,0 +1,248 @@
+/*
+MIT License
+
+Copyright (c) 2025 Adam Sawicki, https://asawicki.info
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "../src/precompiled_header.hpp"
+
+#include <chrono>
+#include <clocale>
+#include <filesystem>
+#include <iostream>
+
+/*
+Command line driver of the plugin for the host build described in README. It calls
+the exported WCX functions like Total Commander does and prints how long each
+operation took, so packing and reading can be benchmarked on Linux. Archive is read
+through mmap, or through FILE* with --no-mmap.
+*/
+
+extern "C" HANDLE __stdcall OpenArchiveW(tOpenArchiveDataW* archiveData);
+extern "C" int __stdcall CloseArchive(HANDLE hArcData);
+extern "C" int __stdcall ReadHeaderExW(HANDLE hArcData, tHeaderDataExW* headerData);
+extern "C" int __stdcall ProcessFileW(HANDLE hArcData, int operation, wchar_t* destPath, wchar_t* destName);
+extern "C" int __stdcall PackFilesW(wchar_t* packedFile, wchar_t* subPath, wchar_t* srcPath, wchar_t* addList, int flags);
+extern "C" int __stdcall DeleteFilesW(wchar_t* packedFile, wchar_t* deleteList);
+
+namespace fs = std::filesystem;
+
+static const char* const kUsage =
+    "Usage: smpa_host [options] <command> <archive> [arguments]\n"
+    "Commands:\n"
+    "  pack <archive> <source_dir> [path...]  create new archive from paths in source_dir, all by default\n"
+    "  add <archive> <source_dir> [path...]   add paths to existing archive, all by default\n"
+    "  list <archive>                         read headers of all entries\n"
+    "  test <archive>                         decompress and verify all entries\n"
+    "  extract <archive> <dest_dir>           extract all entries\n"
+    "  delete <archive> <path...>             delete entries or directories\n"
+    "Options:\n"
+    "  --no-mmap     read archive through FILE* instead of a memory mapping\n"
+    "  --repeat N    run the command N times\n";
+
+struct Result
+{
+    int error_code = 0;
+    uint64_t entry_count = 0;
+    // Unpacked size of entries read, or size of source files packed.
+    uint64_t byte_count = 0;
+};
+
+static std::wstring ToWide(const std::string& str)
+{
+    std::wstring result(str.length() + 1, L'\0');
+    const size_t len = mbstowcs(result.data(), str.c_str(), result.size());
+    if(len == (size_t)-1)
+        return std::wstring(str.begin(), str.end());
+    result.resize(len);
+    return result;
+}
+
+// Appends path and its terminating zero to list, with backslashes like Total Commander.
+static void AppendToList(std::wstring& list, const fs::path& path)
+{
+    std::wstring str = ToWide(path.generic_string());
+    std::replace(str.begin(), str.end(), L'/', L'\\');
+    list += str;
+    list.push_back(L'\0');
+}
+
+// Lists paths relative to source_dir, with contents of directories after them.
+static std::wstring MakeAddList(const fs::path& source_dir, const std::vector<std::string>& paths,
+    uint64_t& out_byte_count)
+{
+    std::vector<fs::path> roots;
+    if(paths.empty())
+    {
+        for(const fs::directory_entry& entry : fs::directory_iterator(source_dir))
+            roots.push_back(entry.path().lexically_relative(source_dir));
+    }
+    else
+        roots.assign(paths.begin(), paths.end());
+    std::sort(roots.begin(), roots.end());
+
+    std::wstring list;
+    out_byte_count = 0;
+    for(const fs::path& root : roots)
+    {
+        AppendToList(list, root);
+        if(!fs::is_directory(source_dir / root))
+        {
+            out_byte_count += fs::file_size(source_dir / root);
+            continue;
+        }
+        std::vector<fs::path> children;
+        for(const fs::directory_entry& entry : fs::recursive_directory_iterator(source_dir / root))
+            children.push_back(entry.path());
+        std::sort(children.begin(), children.end());
+        for(const fs::path& child : children)
+        {
+            AppendToList(list, child.lexically_relative(source_dir));
+            if(!fs::is_directory(child))
+                out_byte_count += fs::file_size(child);
+        }
+    }
+    list.push_back(L'\0');
+    return list;
+}
+
+// Calls ProcessFileW with operation for every entry.
+static Result ProcessArchive(const std::wstring& archive_path, int operation, const std::wstring& dest_dir)
+{
+    Result result;
+    tOpenArchiveDataW open_data = {};
+    open_data.ArcName = const_cast<wchar_t*>(archive_path.c_str());
+    open_data.OpenMode = operation == PK_SKIP ? PK_OM_LIST : PK_OM_EXTRACT;
+    HANDLE archive = OpenArchiveW(&open_data);
+    if(!archive)
+    {
+        result.error_code = open_data.OpenResult;
+        return result;
+    }
+    tHeaderDataExW header_data;
+    int error_code;
+    while((error_code = ReadHeaderExW(archive, &header_data)) == 0)
+    {
+        error_code = ProcessFileW(archive, operation,
+            operation == PK_EXTRACT ? const_cast<wchar_t*>(dest_dir.c_str()) : nullptr,
+            operation == PK_EXTRACT ? header_data.FileName : nullptr);
+        if(error_code != 0)
+            break;
+        ++result.entry_count;
+        result.byte_count += ((uint64_t)header_data.UnpSizeHigh << 32) | header_data.UnpSize;
+    }
+    if(error_code != E_END_ARCHIVE)
+        result.error_code = error_code;
+    CloseArchive(archive);
+    return result;
+}
+
+static Result RunCommand(const std::string& command, const std::wstring& archive_path,
+    const std::vector<std::string>& args)
+{
+    Result result;
+    if(command == "pack" || command == "add")
+    {
+        const fs::path source_dir = args[0];
+        const std::vector<std::string> paths(args.begin() + 1, args.end());
+        std::wstring add_list = MakeAddList(source_dir, paths, result.byte_count);
+        if(command == "pack")
+            ::DeleteFileW(archive_path.c_str());
+        std::wstring src_path = ToWide(source_dir.string()) + L"\\";
+        result.error_code = PackFilesW(const_cast<wchar_t*>(archive_path.c_str()), nullptr,
+            src_path.data(), add_list.data(), PK_PACK_SAVE_PATHS);
+    }
+    else if(command == "delete")
+    {
+        std::wstring delete_list;
+        for(const std::string& path : args)
+            AppendToList(delete_list, path);
+        delete_list.push_back(L'\0');
+        result.error_code = DeleteFilesW(const_cast<wchar_t*>(archive_path.c_str()), delete_list.data());
+    }
+    else if(command == "list")
+        result = ProcessArchive(archive_path, PK_SKIP, std::wstring());
+    else if(command == "test")
+        result = ProcessArchive(archive_path, PK_TEST, std::wstring());
+    else
+    {
+        assert(command == "extract");
+        fs::create_directories(args[0]);
+        result = ProcessArchive(archive_path, PK_EXTRACT, ToWide(args[0]) + L"\\");
+    }
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    setlocale(LC_ALL, "");
+
+    int repeat_count = 1;
+    std::vector<std::string> args;
+    for(int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if(arg == "--no-mmap")
+            host::g_disable_mapping = true;
+        else if(arg == "--repeat" && i + 1 < argc)
+            repeat_count = std::max(1, atoi(argv[++i]));
+        else
+            args.push_back(arg);
+    }
+    if(args.size() < 2)
+    {
+        std::cerr << kUsage;
+        return 2;
+    }
+    const std::string command = args[0];
+    const std::wstring archive_path = ToWide(args[1]);
+    args.erase(args.begin(), args.begin() + 2);
+    const bool is_pack = command == "pack" || command == "add";
+    if(!((is_pack && !args.empty()) || (command == "delete" && !args.empty()) ||
+        ((command == "list" || command == "test") && args.empty()) ||
+        (command == "extract" && args.size() == 1)))
+    {
+        std::cerr << kUsage;
+        return 2;
+    }
+
+    for(int run = 0; run < repeat_count; ++run)
+    {
+        const auto begin_time = std::chrono::steady_clock::now();
+        const Result result = RunCommand(command, archive_path, args);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin_time).count();
+        if(result.error_code != 0)
+        {
+            std::cerr << command << " failed with error " << result.error_code << "\n";
+            return 1;
+        }
+        printf("%s: %.1f ms", command.c_str(), seconds * 1000.0);
+        if(!is_pack && command != "delete")
+            printf(", %llu entries", (unsigned long long)result.entry_count);
+        // Listing doesn't read file data.
+        if(result.byte_count > 0 && command != "list")
+        {
+            printf(", %llu bytes, %.1f MB/s", (unsigned long long)result.byte_count,
+                seconds > 0.0 ? (double)result.byte_count / seconds / 1e6 : 0.0);
+        }
+        printf("\n");
+    }
+    return 0;
+}
@@ -23,28 +23,9 @@ SOFTWARE.
 */
 #include "precompiled_header.hpp"
 #include "archive.hpp"
+#include "checksum.hpp"
 #include "third_party/zlib-1.3.1/zlib.h"
 
-// Deleter for STL smart pointers like std::unique_ptr that calls deflateEnd on
-// destruction.
-struct DeflateEndDeleter
-{
-    void operator()(z_stream* s) const
-    {
-        deflateEnd(s);
-    }
-};
-
-// Deleter for STL smart pointers like std::unique_ptr that calls inflateEnd on
-// destruction.
-struct InflateEndDeleter
-{
-    void operator()(z_stream* s) const
-    {
-        inflateEnd(s);
-    }
-};
-
 enum FILE_ATTR
 {
     // From WCX Writer's Reference, tHeaderDataEx::FileAttr member.
@@ -59,11 +40,119 @@ enum FILE_ATTR
 
 static const size_t kMaxFileNameLen = 1024; // countof(tHeaderDataEx::FileName).
 static const bool kEnableCompression = true;
-static constexpr std::string_view kFileHeader = "SMPA100A";
+static const bool kEnableCentralDirectory = true;
+static constexpr std::string_view kFileHeader = "SMPA110A";
+// Written by previous versions, which didn't use extra fields. Still supported.
+static constexpr std::string_view kFileHeaderV100 = "SMPA100A";
 static const uint32_t kEntryMagic = 0x1743C8F1;
+static const uint32_t kCentralDirectoryMagic = 0x1743C8F2;
+static const uint32_t kDataDescriptorMagic = 0x1743C8F3;
+static constexpr std::wstring_view kCentralDirectoryPath = L"$CENTRAL_DIRECTORY";
+// Smallest and initial size of buffers for entry data. IoBufferSizer makes them
+// larger when that is faster.
 static const size_t kBufSize = 0x10000; // 64 KB
+// Buffers for entry data read ahead and written behind take at most this much memory.
+static const size_t kMaxIoBufferMemory = 0x4000000; // 64 MB
 static const uint64_t kProgressUpdateIntervalMilliseconds = 40; // 25 times per second.
 static const uint64_t kMinFileSizeForCompression = 16;
+// Codec used for new entries. kCodecLz decompresses much faster, kCodecZlib compresses better.
+static const CodecId kPackCodec = kCodecZlib;
+static const bool kEnableSolidCompression = true;
+// Compressible files up to this size are packed together in solid blocks.
+static const uint64_t kMaxSolidFileSize = 0x20000; // 128 KB
+// Solid block is written when its unpacked data reaches this size.
+static const size_t kSolidBlockSize = 0x100000; // 1 MB
+static constexpr std::wstring_view kSolidBlockPath = L"$SOLID_BLOCK";
+static const bool kEnableCompressibilityCheck = true;
+// Beginning of the file compressed as a trial to check if compression is worth it.
+static const size_t kCompressibilitySampleSize = 0x10000; // 64 KB
+// File is stored without compression if its sample doesn't compress below this ratio.
+static const double kMaxSampleCompressionRatio = 0.95;
+static const bool kEnablePackPipeline = true;
+// Threads reading the current and the next source file and writing the archive.
+static const uint32_t kPackPipelineThreadCount = 3;
+// File is read ahead by up to this many chunks.
+static const size_t kReadAheadChunkCount = 16;
+// Data waits for writing in up to this many buffers.
+static const size_t kMaxPendingWrites = 16;
+static const bool kEnableParallelCompression = true;
+static const size_t kParallelCompressionBlockSize = 0x100000; // 1 MB
+static const uint64_t kMinFileSizeForParallelCompression = 4 * kParallelCompressionBlockSize;
+// Compressed files get seek points, where decoding can start, so a part of a large file
+// can be read without decoding all data before it.
+static const bool kEnableSeekPoints = true;
+// Must be a multiple of kParallelCompressionBlockSize. Each point costs compression
+// ratio, as data after it can't reference data before it.
+static const uint64_t kMinSeekPointInterval = 4 * kParallelCompressionBlockSize; // 4 MB
+// Larger files get sparser seek points, so their table fits in extra fields.
+static const uint64_t kMaxSeekPoints = 4096;
+static const size_t kDeflateWindowSize = 0x8000; // 32 KB
+// Dictionary is trained for zlib from files packed into an archive that has none yet.
+static const bool kEnableDictionary = true;
+// Larger dictionary is useless, as deflate can't reference data farther back.
+static const size_t kMaxDictionarySize = kDeflateWindowSize;
+static const size_t kMinDictionarySize = 0x100; // 256 B
+// Dictionary is trained only if there are at least this many small files to sample.
+static const size_t kMinDictionarySamples = 8;
+static const size_t kMaxDictionarySamples = 256;
+// Beginning of a file taken as a sample for dictionary training.
+static const size_t kDictionarySampleSize = 0x800; // 2 KB
+// Dictionary larger than this fraction of sampled data overfits the samples and costs
+// more space than it saves, as it is stored uncompressed.
+static const size_t kSampleBytesPerDictionaryByte = 16;
+static constexpr std::wstring_view kDictionaryPath = L"$DICTIONARY";
+static const bool kEnableParallelExtraction = true;
+// Extracted data is written by pipeline threads, and archive that isn't mapped is read ahead.
+static const bool kEnableExtractPipeline = true;
+// Disk space for extracted files of at least this size is reserved before writing.
+static const uint64_t kMinFileSizeForPreallocation = 0x100000; // 1 MB
+// Stored data is extracted in chunks of up to this size, written directly from where it
+// was read. Small enough to stay in cache between computing CRC-32 and writing.
+static const size_t kMaxStoredChunkSize = 0x100000; // 1 MB
+static const size_t kMaxPendingExtractionsPerThread = 4;
+// File with the same size, CRC-32 and content hash as a file already in the archive is
+// stored as a duplicate referring to its data. Files that may have a duplicate in the
+// archive are read twice: first to check for it, then to pack them.
+static const bool kEnableDeduplication = true;
+// Smaller files are not worth an extra field for the content hash.
+static const uint64_t kMinFileSizeForDeduplication = 0x10000; // 64 KB
+// PackFilesW keeps the entry of a file being added, instead of packing the file
+// again, if its size, time and attributes are the same as in the entry.
+static const bool kEnableIncrementalUpdate = true;
+// Such a file is also read to compare its CRC-32, and content hash if the entry has one.
+// Catches changes that kept size and time, but costs reading all files to add.
+static const bool kVerifyUnchangedFileContent = false;
+static const bool kEnableCompaction = true;
+// Archive is compacted when deleted entries take at least this part of it.
+static const double kMinDeletedRatioForCompaction = 0.25;
+static const size_t kCompactionBufSize = 0x100000; // 1 MB
+// Compacted archive is written next to the archive, to a file with this suffix
+// added to its name, which then replaces the archive.
+static constexpr std::wstring_view kCompactionTempFileSuffix = L".compact.tmp";
+// Path of a deleted entry covering free space left by a new entry moved into space
+// of deleted entries.
+static constexpr std::wstring_view kFreeSpacePath = L"$FREE_SPACE";
+static const uint64_t kFreeSpaceEntryMinSize = sizeof(EntryHeader) + kFreeSpacePath.length() * sizeof(wchar_t);
+// New entries are moved into space of deleted entries that fits them, so the archive
+// doesn't grow when files are replaced again and again. Entries are written at the end
+// first, as their packed size is not known in advance, then copied.
+static const bool kEnableFreeSpaceReuse = true;
+// Entries that are not files and are never listed or passed to DeleteIf predicate.
+static const uint8_t kEntryFlagsInternal = kEntryFlagSolidBlock | kEntryFlagDictionary;
+
+// Converts to local DOS date and time, used for EntryHeader::time.
+static uint32_t FileTimeToWcxTime(const FILETIME& file_time)
+{
+    FILETIME local_time;
+    BOOL b = FileTimeToLocalFileTime(&file_time, &local_time);
+    if(!b)
+        throw E_UNKNOWN_FORMAT;
+    WORD dos_date, dos_time;
+    b = FileTimeToDosDateTime(&local_time, &dos_date, &dos_time);
+    if(!b)
+        throw E_UNKNOWN_FORMAT;
+    return ((uint32_t)dos_date << 16) | (uint32_t)dos_time;
+}
 
 static uint8_t WindowsAttributesToWcxAttributes(DWORD windows_attr)
 {
@@ -81,24 +170,286 @@ static uint8_t WindowsAttributesToWcxAttributes(DWORD windows_attr)
     return wcx_attr;
 }
 
-static void ZlibResultToWcxException(int zlib_result)
+static inline bool EnableCompressionForFile(uint64_t file_size)
+{
+    return kEnableCompression && file_size >= kMinFileSizeForCompression;
+}
+
+// Returns the largest power of 2 buffer size, at least kBufSize, such that
+// buffer_count buffers fit in kMaxIoBufferMemory.
+static size_t CalcMaxIoBufferSize(size_t buffer_count)
+{
+    size_t size = kBufSize;
+    while(size * 2 * buffer_count <= kMaxIoBufferMemory)
+        size *= 2;
+    return size;
+}
+
+/*
+Compresses the beginning of src_file with the fastest level to detect data that
+is already compressed, like JPEG or ZIP. Output buffer is limited by
+kMaxSampleCompressionRatio, so incompressible data fails early. Doesn't consume
+data of src_file.
+*/
+static bool IsSampleCompressible(ReadAheadFile& src_file, CodecPool& codec_pool)
+{
+    // First chunk is the sample, as the file is read in chunks of at least kBufSize or the whole file.
+    static_assert(kCompressibilitySampleSize <= kBufSize);
+    const std::span<const char> src_data = src_file.Peek();
+    const size_t sample_size = std::min(src_data.size(), kCompressibilitySampleSize);
+    if(sample_size == 0)
+        return false;
+
+    z_stream zlib_stream;
+    ZeroMemory(&zlib_stream, sizeof(zlib_stream));
+    codec_pool.SetZlibAllocator(zlib_stream);
+    int zlib_result = deflateInit(&zlib_stream, Z_BEST_SPEED);
+    ZlibResultToWcxException(zlib_result);
+    std::unique_ptr<z_stream, DeflateEndDeleter> zlib_stream_ptr(&zlib_stream);
+
+    std::vector<char> dst_buf((size_t)(sample_size * kMaxSampleCompressionRatio));
+    zlib_stream.next_in = (Bytef*)src_data.data();
+    zlib_stream.avail_in = (uInt)sample_size;
+    zlib_stream.next_out = (Bytef*)dst_buf.data();
+    zlib_stream.avail_out = (uInt)dst_buf.size();
+    zlib_result = deflate(&zlib_stream, Z_FINISH);
+    if(zlib_result != Z_OK && zlib_result != Z_STREAM_END && zlib_result != Z_BUF_ERROR)
+        ZlibResultToWcxException(zlib_result);
+    // Stream couldn't be finished means the output buffer was too small.
+    return zlib_result == Z_STREAM_END;
+}
+
+/*
+Block of source data compressed independently of others by a job on a thread
+pool. It is raw deflate data, primed with the last kDeflateWindowSize bytes of
+the previous block as a preset dictionary. Blocks other than the last end with
+Z_SYNC_FLUSH, so they are byte-aligned and can be simply concatenated.
+*/
+struct ParallelDeflateBlock
+{
+    std::vector<char> dictionary;
+    std::vector<char> src;
+    std::vector<char> dst;
+    uLong adler = 0;
+    uint32_t crc32 = 0;
+    bool is_last = false;
+    // Block begins at a seek point, so it has no dictionary.
+    bool is_seek_point = false;
+    std::future<void> done;
+};
+
+static void DeflateBlock(ParallelDeflateBlock& block, CodecPool& codec_pool)
 {
-    switch(zlib_result)
+    z_stream zlib_stream;
+    ZeroMemory(&zlib_stream, sizeof(zlib_stream));
+    codec_pool.SetZlibAllocator(zlib_stream);
+    // Negative window bits - raw deflate, without zlib header and trailer.
+    int zlib_result = deflateInit2(&zlib_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+        -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    ZlibResultToWcxException(zlib_result);
+    std::unique_ptr<z_stream, DeflateEndDeleter> zlib_stream_ptr(&zlib_stream);
+
+    if(!block.dictionary.empty())
     {
-    case Z_OK:
-        break;
-    case Z_MEM_ERROR:
-        throw E_NO_MEMORY;
-    case Z_STREAM_ERROR:
-        throw E_BAD_ARCHIVE;
-    default:
-        throw E_BAD_DATA;
+        zlib_result = deflateSetDictionary(&zlib_stream,
+            (const Bytef*)block.dictionary.data(), (uInt)block.dictionary.size());
+        ZlibResultToWcxException(zlib_result);
+    }
+
+    block.adler = adler32(1, (const Bytef*)block.src.data(), (uInt)block.src.size());
+    block.crc32 = Crc32(0, block.src.data(), block.src.size());
+
+    // Output almost never exceeds the bound. If it does, the buffer is grown.
+    block.dst.resize(deflateBound(&zlib_stream, (uLong)block.src.size()) + 16);
+    zlib_stream.next_in = (Bytef*)block.src.data();
+    zlib_stream.avail_in = (uInt)block.src.size();
+    size_t bytes_written = 0;
+    for(;;)
+    {
+        zlib_stream.next_out = (Bytef*)block.dst.data() + bytes_written;
+        zlib_stream.avail_out = (uInt)(block.dst.size() - bytes_written);
+        zlib_result = deflate(&zlib_stream, block.is_last ? Z_FINISH : Z_SYNC_FLUSH);
+        if(zlib_result != Z_OK && zlib_result != Z_STREAM_END && zlib_result != Z_BUF_ERROR)
+            ZlibResultToWcxException(zlib_result);
+        bytes_written = block.dst.size() - zlib_stream.avail_out;
+        if(zlib_stream.avail_out != 0 && zlib_stream.avail_in == 0)
+        {
+            if(!block.is_last || zlib_result == Z_STREAM_END)
+                break;
+        }
+        block.dst.resize(block.dst.size() * 2);
     }
+    block.dst.resize(bytes_written);
 }
 
-static inline bool EnableCompressionForFile(uint64_t file_size)
+// Returns size of the whole entry in the archive file: header, path, extra fields, data,
+// data descriptor.
+static uint64_t GetEntrySize(const IndexEntry& entry)
 {
-    return kEnableCompression && file_size >= kMinFileSizeForCompression;
+    return GetEntryHeaderSize(entry.header, entry.extra_fields.size()) + GetEntryDataSize(entry.header);
+}
+
+// Appends EntryHeader with path and extra fields, as they are stored in the archive.
+static void AppendEntryHeader(std::vector<char>& dst, const EntryHeader& header, const wstr_view& path,
+    const std::vector<char>& extra_fields)
+{
+    if(header.attributes & FILE_ATTR_DIRECTORY)
+        assert(header.pack_size == 0);
+
+    const char* header_ptr = (const char*)&header;
+    const char* path_ptr = (const char*)path.data();
+    dst.insert(dst.end(), header_ptr, header_ptr + sizeof(header));
+    dst.insert(dst.end(), path_ptr, path_ptr + path.length() * sizeof(wchar_t));
+    if(header.flags & kEntryFlagExtraFields)
+    {
+        assert(extra_fields.size() <= USHRT_MAX);
+        const uint16_t extra_fields_size = (uint16_t)extra_fields.size();
+        const char* size_ptr = (const char*)&extra_fields_size;
+        dst.insert(dst.end(), size_ptr, size_ptr + sizeof(extra_fields_size));
+        dst.insert(dst.end(), extra_fields.begin(), extra_fields.end());
+    }
+    else
+        assert(extra_fields.empty());
+}
+
+// Appends central directory entry describing index, to be placed at entry_offset.
+static void AppendCentralDirectory(std::vector<char>& dst, std::span<const IndexEntry> index, uint64_t entry_offset)
+{
+    std::vector<char> buf;
+    for(const IndexEntry& entry : index)
+    {
+        const char* offset_ptr = (const char*)&entry.offset;
+        buf.insert(buf.end(), offset_ptr, offset_ptr + sizeof(entry.offset));
+        AppendEntryHeader(buf, entry.header, entry.path, entry.extra_fields);
+    }
+
+    CentralDirectoryTrailer trailer = {};
+    trailer.entry_offset = entry_offset;
+    trailer.record_count = index.size();
+    trailer.magic = kCentralDirectoryMagic;
+    const char* trailer_ptr = (const char*)&trailer;
+    buf.insert(buf.end(), trailer_ptr, trailer_ptr + sizeof(trailer));
+
+    EntryHeader header = {};
+    header.magic = kEntryMagic;
+    header.flags = kEntryFlagDeleted | kEntryFlagCentralDirectory;
+    header.pack_size = buf.size();
+    header.unp_size = buf.size();
+    header.path_len = (uint16_t)kCentralDirectoryPath.length();
+
+    AppendEntryHeader(dst, header, wstr_view(kCentralDirectoryPath.data(), kCentralDirectoryPath.length()), {});
+    dst.insert(dst.end(), buf.begin(), buf.end());
+}
+
+static void AppendExtraField(std::vector<char>& extra_fields, ExtraFieldTag tag,
+    const void* data, uint16_t size)
+{
+    const uint16_t field_header[] = { (uint16_t)tag, size };
+    const char* field_header_ptr = (const char*)field_header;
+    extra_fields.insert(extra_fields.end(), field_header_ptr, field_header_ptr + sizeof(field_header));
+    extra_fields.insert(extra_fields.end(), (const char*)data, (const char*)data + size);
+}
+
+// Returns offset of data of the first extra field with tag and size in raw extra fields.
+// Throws if there is none.
+static size_t FindExtraField(const std::vector<char>& extra_fields, ExtraFieldTag tag, uint16_t size)
+{
+    size_t offset = 0;
+    while(offset < extra_fields.size())
+    {
+        uint16_t field_header[2];
+        if(extra_fields.size() - offset < sizeof(field_header))
+            throw E_BAD_ARCHIVE;
+        memcpy(field_header, extra_fields.data() + offset, sizeof(field_header));
+        offset += sizeof(field_header);
+        if(extra_fields.size() - offset < field_header[1])
+            throw E_BAD_ARCHIVE;
+        if(field_header[0] == tag && field_header[1] == size)
+            return offset;
+        offset += field_header[1];
+    }
+    throw E_BAD_ARCHIVE;
+}
+
+// Overwrites value of existing kExtraFieldCrc32 in raw extra fields.
+static void SetExtraFieldCrc32(std::vector<char>& extra_fields, uint32_t crc32)
+{
+    memcpy(extra_fields.data() + FindExtraField(extra_fields, kExtraFieldCrc32, sizeof(crc32)), &crc32, sizeof(crc32));
+}
+
+static EntryExtra ParseExtraFields(const std::vector<char>& extra_fields)
+{
+    EntryExtra extra;
+    size_t offset = 0;
+    while(offset < extra_fields.size())
+    {
+        uint16_t field_header[2];
+        if(extra_fields.size() - offset < sizeof(field_header))
+            throw E_BAD_ARCHIVE;
+        memcpy(field_header, extra_fields.data() + offset, sizeof(field_header));
+        offset += sizeof(field_header);
+        const uint16_t tag = field_header[0];
+        const uint16_t size = field_header[1];
+        if(extra_fields.size() - offset < size)
+            throw E_BAD_ARCHIVE;
+        const char* data = extra_fields.data() + offset;
+        offset += size;
+
+        switch(tag)
+        {
+        case kExtraFieldCrc32:
+            if(size != sizeof(extra.crc32))
+                throw E_BAD_ARCHIVE;
+            memcpy(&extra.crc32, data, sizeof(extra.crc32));
+            extra.has_crc32 = true;
+            break;
+        case kExtraFieldCodec:
+            if(size != sizeof(extra.codec))
+                throw E_BAD_ARCHIVE;
+            memcpy(&extra.codec, data, sizeof(extra.codec));
+            break;
+        case kExtraFieldSolidOffset:
+            if(size != sizeof(extra.solid_offset))
+                throw E_BAD_ARCHIVE;
+            memcpy(&extra.solid_offset, data, sizeof(extra.solid_offset));
+            break;
+        case kExtraFieldDictionaryId:
+            if(size != sizeof(extra.dictionary_id))
+                throw E_BAD_ARCHIVE;
+            memcpy(&extra.dictionary_id, data, sizeof(extra.dictionary_id));
+            break;
+        case kExtraFieldSeekTable:
+            if(size < sizeof(uint64_t) || size % sizeof(uint64_t) != 0)
+                throw E_BAD_ARCHIVE;
+            memcpy(&extra.seek_interval, data, sizeof(extra.seek_interval));
+            extra.seek_offsets.resize(size / sizeof(uint64_t) - 1);
+            memcpy(extra.seek_offsets.data(), data + sizeof(uint64_t), size - sizeof(uint64_t));
+            break;
+        case kExtraFieldContentHash:
+            if(size != sizeof(extra.content_hash))
+                throw E_BAD_ARCHIVE;
+            memcpy(&extra.content_hash, data, sizeof(extra.content_hash));
+            break;
+        case kExtraFieldDuplicateOf:
+            if(size != sizeof(extra.duplicate_of))
+                throw E_BAD_ARCHIVE;
+            memcpy(&extra.duplicate_of, data, sizeof(extra.duplicate_of));
+            break;
+        default:
+            // Unknown field, written by newer version. Skip it.
+            break;
+        }
+    }
+    return extra;
+}
+
+// Returns content hash of an entry with own data that duplicates can refer to, or 0.
+static uint64_t GetContentHash(const EntryHeader& header, const std::vector<char>& extra_fields)
+{
+    if((header.flags & kEntryFlagExtraFields) == 0 ||
+        (header.flags & (kEntryFlagSolid | kEntryFlagsInternal | kEntryFlagCentralDirectory)) != 0)
+        return 0;
+    return ParseExtraFields(extra_fields).content_hash;
 }
 
 static std::vector<std::wstring> ParseStringList(const wchar_t* list)
@@ -136,7 +487,7 @@ void ReadingArchive::OpenArchiveW(tOpenArchiveDataW *archiveData)
         throw E_NOT_SUPPORTED;
     }
 
-    if(UpdateBytesProcessedProgress())
+    if(UpdateProgress())
         throw E_EABORTED;
 
     FILE *f = nullptr;
@@ -144,11 +495,25 @@ void ReadingArchive::OpenArchiveW(tOpenArchiveDataW *archiveData)
     if(e != 0)
         throw E_EOPEN;
     archive_file_.reset(f);
-    if(UpdateBytesProcessedProgress())
+    // If mapping fails, data is read through archive_file_.
+    archive_mapping_.Open(f);
+    mapped_offset_ = 0;
+    if(kEnableParallelExtraction && archive_mapping_.IsOpen())
+        thread_pool_ = std::make_unique<ThreadPool>();
+    // One writer per extraction job that can run at the same time, plus a reader.
+    if(kEnableExtractPipeline && mode_ == ArchiveMode::kExtract)
+        pipeline_thread_pool_ = std::make_unique<ThreadPool>((thread_pool_ ? thread_pool_->GetThreadCount() : 1) + 1);
+    // Each extraction job has its buffers waiting for writing plus one being
+    // filled, the synchronous one also reads ahead.
+    const size_t job_count = thread_pool_ ? thread_pool_->GetThreadCount() : 1;
+    io_buffer_sizer_ = std::make_unique<IoBufferSizer>(kBufSize,
+        CalcMaxIoBufferSize(job_count * (kMaxPendingWrites + 2) + kReadAheadChunkCount + 1));
+    if(UpdateProgress())
         throw E_EABORTED;
 
     ReadAndCheckHeader();
-    if(UpdateBytesProcessedProgress())
+    ReadCentralDirectory();
+    if(UpdateProgress())
         throw E_EABORTED;
 }
 
@@ -156,22 +521,57 @@ int ReadingArchive::ReadHeaderExW(tHeaderDataExW *headerData)
 {
     assert(mode_ == ArchiveMode::kList || mode_ == ArchiveMode::kExtract);
 
-    ZeroMemory(headerData, sizeof(headerData));
+    ZeroMemory(headerData, sizeof(*headerData));
 
     for(;;)
     {
+        if(has_central_directory_)
+        {
+            if(next_index_entry_ == index_.size())
+            {
+                WaitForExtractions(0);
+                return E_END_ARCHIVE;
+            }
+            const IndexEntry& entry = index_[next_index_entry_++];
+            if((entry.header.flags & kEntryFlagDeleted) != 0)
+                continue;
+            if((entry.header.flags & kEntryFlagsInternal) != 0)
+            {
+                PassInternalEntry(entry);
+                continue;
+            }
+            last_header_ = entry.header;
+            last_header_path_ = entry.path;
+            last_header_extra_fields_ = entry.extra_fields;
+            last_content_offset_ = entry.offset + GetEntryHeaderSize(entry.header, entry.extra_fields.size());
+            bytes_processed_since_previous_progress_ += last_content_offset_ - entry.offset;
+            if(UpdateProgress())
+                return E_EABORTED;
+            break;
+        }
+
+        const uint64_t entry_offset = TellArchive();
         if(!ReadEntryHeader())
+        {
+            WaitForExtractions(0);
             return E_END_ARCHIVE;
-        if(UpdateBytesProcessedProgress())
+        }
+        if(UpdateProgress())
             return E_EABORTED;
-        if((last_header_.flags & kEntryFlagDeleted) != 0)
+        // Deleted entries too, as their data may still be used by duplicates.
+        if(const uint64_t content_hash = GetContentHash(last_header_, last_header_extra_fields_); content_hash != 0)
+            content_entries_.emplace(content_hash, IndexEntry{entry_offset, last_header_, last_header_path_, last_header_extra_fields_});
+        if((last_header_.flags & (kEntryFlagDeleted | kEntryFlagsInternal)) != 0)
         {
+            if((last_header_.flags & kEntryFlagDeleted) == 0)
+                PassInternalEntry(IndexEntry{entry_offset, last_header_, last_header_path_, last_header_extra_fields_});
             // Skip contents and read header again.
-            if(last_header_.pack_size != 0)
+            const uint64_t data_size = GetEntryDataSize(last_header_);
+            if(data_size != 0)
             {
-                SeekOrThrow(archive_file_.get(), (long long)last_header_.pack_size, SEEK_CUR);
-                bytes_processed_since_previous_progress_ += last_header_.pack_size;
-                if(UpdateBytesProcessedProgress())
+                SeekArchive((long long)data_size, SEEK_CUR);
+                bytes_processed_since_previous_progress_ += data_size;
+                if(UpdateProgress())
                     throw E_EABORTED;
             }
         }
@@ -182,18 +582,24 @@ int ReadingArchive::ReadHeaderExW(tHeaderDataExW *headerData)
         }
     }
 
+    const EntryExtra extra = ParseExtraFields(last_header_extra_fields_);
+
     // Validate parameters.
     if((last_header_.attributes & FILE_ATTR_DIRECTORY) &&
         (last_header_.pack_size > 0 || last_header_.unp_size > 0))
     {
         return E_BAD_ARCHIVE;
     }
-    if((last_header_.flags & kEntryFlagCompressed) == 0 &&
+    if((last_header_.flags & (kEntryFlagCompressed | kEntryFlagSolid)) == 0 && extra.duplicate_of == 0 &&
         last_header_.unp_size != last_header_.pack_size)
     {
         return E_BAD_ARCHIVE;
     }
+    if(((last_header_.flags & kEntryFlagSolid) || extra.duplicate_of != 0) && last_header_.pack_size > 0)
+        return E_BAD_ARCHIVE;
 
+    if(extra.has_crc32)
+        headerData->FileCRC = (int)extra.crc32;
     headerData->FileAttr = (int)last_header_.attributes;
     wcscpy_s(headerData->FileName, last_header_path_.c_str());
     headerData->FileTime = (int)last_header_.time;
@@ -212,17 +618,25 @@ int ReadingArchive::ProcessFileW(int operation, wchar_t *destPath, wchar_t *dest
     switch(operation)
     {
     case PK_SKIP:
-    case PK_TEST:
-        if(last_header_.pack_size != 0)
+        if(const uint64_t data_size = GetEntryDataSize(last_header_); data_size != 0)
         {
-            SeekOrThrow(archive_file_.get(), (long long)last_header_.pack_size, SEEK_CUR);
-            bytes_processed_since_previous_progress_ += last_header_.pack_size;
-            if(UpdateBytesProcessedProgress())
+            // With central directory, next entry is found by its offset, so no seek is needed.
+            if(!has_central_directory_)
+                SeekArchive((long long)data_size, SEEK_CUR);
+            bytes_processed_since_previous_progress_ += data_size;
+            if(UpdateProgress())
                 throw E_EABORTED;
         }
         return 0;
 
+    case PK_TEST:
+        SeekToLastEntryData();
+        if((last_header_.attributes & FILE_ATTR_DIRECTORY) == 0)
+            ProcessFileData(std::wstring());
+        return 0;
+
     case PK_EXTRACT:
+        SeekToLastEntryData();
         ExtractFile(destPath, destName);
         return 0;
 
@@ -232,6 +646,184 @@ int ReadingArchive::ProcessFileW(int operation, wchar_t *destPath, wchar_t *dest
     }
 }
 
+size_t ReadingArchive::ReadFileRange(uint64_t offset, char* dst, size_t size)
+{
+    if((last_header_.attributes & FILE_ATTR_DIRECTORY) != 0 || offset >= last_header_.unp_size)
+        return 0;
+    size = (size_t)std::min<uint64_t>(size, last_header_.unp_size - offset);
+
+    EntryExtra extra = ParseExtraFields(last_header_extra_fields_);
+    EntryHeader header = last_header_;
+    SeekToLastEntryData();
+    const uint64_t cursor_offset = TellArchive();
+    SeekToDuplicateData(header, extra);
+    const uint64_t data_offset = TellArchive();
+
+    if(header.flags & kEntryFlagSolid)
+    {
+        LoadSolidBlock();
+        if(extra.solid_offset > solid_block_data_->size() ||
+            header.unp_size > solid_block_data_->size() - extra.solid_offset)
+            throw E_BAD_ARCHIVE;
+        memcpy(dst, solid_block_data_->data() + extra.solid_offset + offset, size);
+        return size;
+    }
+
+    if((header.flags & kEntryFlagCompressed) == 0)
+    {
+        SeekArchive((long long)(data_offset + offset), SEEK_SET);
+        if(ReadArchive(dst, size) != size)
+            throw E_EREAD;
+        SeekArchive((long long)cursor_offset, SEEK_SET);
+        return size;
+    }
+
+    // Decoding starts at the last seek point before offset. Offsets are unknown in the
+    // entry header of a file with data descriptor, when there is no central directory.
+    uint64_t unp_offset = 0;
+    uint64_t pack_offset = 0;
+    const size_t seek_point_index = extra.seek_interval != 0 ?
+        (size_t)std::min<uint64_t>(offset / extra.seek_interval, extra.seek_offsets.size()) : 0;
+    if(seek_point_index > 0 && extra.seek_offsets[seek_point_index - 1] != 0)
+    {
+        unp_offset = seek_point_index * extra.seek_interval;
+        pack_offset = extra.seek_offsets[seek_point_index - 1];
+        if(pack_offset >= header.pack_size)
+            throw E_BAD_ARCHIVE;
+    }
+
+    CodecPool::DecompressorPtr decompressor(nullptr, CodecPool::Releaser{&codec_pool_});
+    if(pack_offset != 0)
+    {
+        decompressor = codec_pool_.AcquireDecompressor(extra.codec);
+        decompressor->ResetAtSeekPoint();
+    }
+    else
+    {
+        std::shared_ptr<const std::vector<char>> dictionary;
+        if(extra.dictionary_id != 0)
+            dictionary = GetDictionary(extra.dictionary_id);
+        decompressor = codec_pool_.AcquireDecompressor(extra.codec,
+            dictionary ? std::span<const char>(*dictionary) : std::span<const char>());
+    }
+
+    SeekArchive((long long)(data_offset + pack_offset), SEEK_SET);
+    uint64_t src_bytes_left = header.pack_size - pack_offset;
+    std::vector<char> src_buf;
+    const char* src_ptr = nullptr;
+    size_t src_bytes_available = 0;
+    // Data before offset is decompressed here and discarded.
+    std::vector<char> skip_buf = buffer_pool_.Acquire(kBufSize);
+    size_t bytes_read = 0;
+    while(bytes_read < size)
+    {
+        if(src_bytes_available == 0 && src_bytes_left > 0)
+        {
+            src_bytes_available = (size_t)std::min<uint64_t>(src_bytes_left, kBufSize);
+            src_ptr = ReadArchiveData(src_buf, src_bytes_available);
+            src_bytes_left -= src_bytes_available;
+        }
+        const size_t src_bytes_before = src_bytes_available;
+        size_t bytes_decompressed = 0;
+        if(unp_offset < offset)
+        {
+            bytes_decompressed = decompressor->Decompress(src_ptr, src_bytes_available,
+                skip_buf.data(), (size_t)std::min<uint64_t>(skip_buf.size(), offset - unp_offset));
+        }
+        else
+        {
+            bytes_decompressed = decompressor->Decompress(src_ptr, src_bytes_available,
+                dst + bytes_read, size - bytes_read);
+            bytes_read += bytes_decompressed;
+        }
+        unp_offset += bytes_decompressed;
+        if(bytes_decompressed == 0 && src_bytes_available == src_bytes_before)
+            throw E_BAD_ARCHIVE;
+    }
+    buffer_pool_.Release(std::move(skip_buf));
+
+    SeekArchive((long long)cursor_offset, SEEK_SET);
+    return size;
+}
+
+void ReadingArchive::PassInternalEntry(const IndexEntry& entry)
+{
+    // Solid block is unpacked only when one of its files is processed.
+    if(entry.header.flags & kEntryFlagSolidBlock)
+        last_solid_block_ = entry;
+    // Dictionary is loaded only when an entry using it is processed.
+    else if(entry.header.flags & kEntryFlagDictionary)
+    {
+        const uint32_t id = ParseExtraFields(entry.extra_fields).dictionary_id;
+        if(id == 0)
+            throw E_BAD_ARCHIVE;
+        dictionaries_.push_back(Dictionary{id, entry});
+    }
+}
+
+void ReadingArchive::SeekToLastEntryData()
+{
+    if(has_central_directory_ && TellArchive() != last_content_offset_)
+        SeekArchive((long long)last_content_offset_, SEEK_SET);
+}
+
+bool ReadingArchive::SeekToDuplicateData(EntryHeader& header, EntryExtra& extra)
+{
+    if(extra.duplicate_of == 0)
+        return false;
+
+    if(has_central_directory_ && !content_entries_loaded_)
+    {
+        for(const IndexEntry& entry : index_)
+        {
+            if(const uint64_t content_hash = GetContentHash(entry.header, entry.extra_fields); content_hash != 0)
+                content_entries_.emplace(content_hash, entry);
+        }
+        content_entries_loaded_ = true;
+    }
+
+    auto [begin, end] = content_entries_.equal_range(extra.duplicate_of);
+    for(auto it = begin; it != end; ++it)
+    {
+        const IndexEntry& entry = it->second;
+        EntryExtra entry_extra = ParseExtraFields(entry.extra_fields);
+        if(entry.header.unp_size != header.unp_size || entry_extra.crc32 != extra.crc32)
+            continue;
+        header.flags = entry.header.flags;
+        header.pack_size = entry.header.pack_size;
+        entry_extra.has_crc32 = extra.has_crc32;
+        extra = std::move(entry_extra);
+        SeekArchive((long long)(entry.offset + GetEntryHeaderSize(entry.header, entry.extra_fields.size())), SEEK_SET);
+        return true;
+    }
+    throw E_BAD_ARCHIVE;
+}
+
+std::shared_ptr<const std::vector<char>> ReadingArchive::GetDictionary(uint32_t id)
+{
+    // The latest one wins if IDs repeat.
+    auto it = std::find_if(dictionaries_.rbegin(), dictionaries_.rend(),
+        [id](const Dictionary& dictionary) { return dictionary.id == id; });
+    if(it == dictionaries_.rend())
+        throw E_BAD_ARCHIVE;
+    if(it->data)
+        return it->data;
+
+    const EntryHeader& header = it->entry.header;
+    if((header.flags & kEntryFlagCompressed) != 0 || header.unp_size != header.pack_size ||
+        header.unp_size > kMaxDictionarySize)
+        throw E_BAD_ARCHIVE;
+
+    const uint64_t cursor_offset = TellArchive();
+    SeekArchive((long long)(it->entry.offset +
+        GetEntryHeaderSize(header, it->entry.extra_fields.size())), SEEK_SET);
+    std::vector<char> src_buf;
+    const char* src_data = ReadArchiveData(src_buf, (size_t)header.unp_size);
+    it->data = std::make_shared<const std::vector<char>>(src_data, src_data + header.unp_size);
+    SeekArchive((long long)cursor_offset, SEEK_SET);
+    return it->data;
+}
+
 void ReadingArchive::ExtractFile(const wstr_view& dest_path, const wstr_view& dest_name)
 {
     std::wstring full_dest_path = CombinePath(dest_path, dest_name);
@@ -239,109 +831,321 @@ void ReadingArchive::ExtractFile(const wstr_view& dest_path, const wstr_view& de
     if (full_dest_path.empty())
         throw E_EWRITE;
 
-    // Directory
+    // Directory. It is always created immediately, so files inside can be extracted
+    // by jobs running later.
     if (last_header_.attributes & FILE_ATTR_DIRECTORY)
     {
         const BOOL b = ::CreateDirectoryW(full_dest_path.c_str(), NULL);
         if (!b)
             throw E_ECREATE;
-        if (UpdateBytesProcessedProgress())
+        if (UpdateProgress())
         {
             ::RemoveDirectoryW(full_dest_path.c_str());
             throw E_EABORTED;
         }
+        SetFileAttributes(full_dest_path.c_str(), last_header_.attributes);
+        SetFileTime(full_dest_path, last_header_.time);
     }
     // File
     else
+        ProcessFileData(full_dest_path);
+}
+
+void ReadingArchive::ProcessFileData(const std::wstring& full_dest_path)
+{
+    EntryExtra extra = ParseExtraFields(last_header_extra_fields_);
+    EntryHeader header = last_header_;
+
+    // Data of a duplicate is read from the entry holding it, then the cursor returns here.
+    const uint64_t cursor_offset = TellArchive();
+    const bool is_duplicate = SeekToDuplicateData(header, extra);
+
+    // Data of a solid file is a range of its unpacked solid block, processed as stored.
+    std::shared_ptr<const std::vector<char>> solid_block_data;
+    if (header.flags & kEntryFlagSolid)
     {
-        try
-        {
-            FILE* dest_file_ptr = nullptr;
-            errno_t e = _wfopen_s(&dest_file_ptr, full_dest_path.c_str(), L"wb");
-            if (e != 0)
-                throw E_ECREATE;
-            UniqueFilePtr file(dest_file_ptr);
-            if (UpdateBytesProcessedProgress())
-                throw E_EABORTED;
+        LoadSolidBlock();
+        solid_block_data = solid_block_data_;
+        if (extra.solid_offset > solid_block_data->size() ||
+            header.unp_size > solid_block_data->size() - extra.solid_offset)
+            throw E_BAD_ARCHIVE;
+        header.pack_size = header.unp_size;
+    }
+    std::shared_ptr<const std::vector<char>> dictionary;
+    if (extra.dictionary_id != 0)
+        dictionary = GetDictionary(extra.dictionary_id);
+    const std::span<const char> dictionary_span = dictionary ? std::span<const char>(*dictionary) : std::span<const char>();
+
+    // Processed by a job on a worker thread. Packed data is read directly from
+    // the mapping, which can be accessed by multiple threads.
+    if (kEnableParallelExtraction && archive_mapping_.IsOpen())
+    {
+        // Previous file extracted to the same path must be finished first.
+        const bool same_path_pending = !full_dest_path.empty() && std::any_of(
+            pending_extractions_.begin(), pending_extractions_.end(),
+            [&full_dest_path](const PendingExtraction& pending)
+            {
+                return _wcsicmp(pending.dest_path.c_str(), full_dest_path.c_str()) == 0;
+            });
+        WaitForExtractions(same_path_pending ? 0 : kMaxPendingExtractionsPerThread * thread_pool_->GetThreadCount() - 1);
 
-            bool is_compressed = (last_header_.flags & kEntryFlagCompressed) != 0;
+        std::vector<char> unused_buf;
+        const char* src_data = solid_block_data ?
+            solid_block_data->data() + extra.solid_offset :
+            ReadArchiveData(unused_buf, (size_t)header.pack_size);
+        auto read_src = [src_data](size_t& size) mutable -> const char*
+        {
+            const char* ptr = src_data;
+            src_data += size;
+            return ptr;
+        };
+        auto progress = [this](uint64_t bytes) -> bool
+        {
+            async_bytes_processed_ += bytes;
+            return extraction_cancelled_;
+        };
+
+        PendingExtraction pending;
+        pending.dest_path = full_dest_path;
+        // Job holds references to the solid block and the dictionary, so they stay
+        // alive when the next ones are loaded.
+        pending.done = thread_pool_->Submit([this, full_dest_path, header, extra, dictionary_span, read_src, progress,
+            solid_block_data, dictionary]()
+            {
+                ExtractFileData(full_dest_path, header, extra, dictionary_span, read_src, progress);
+            });
+        pending_extractions_.push_back(std::move(pending));
 
-            UnpackFileContent(
-                dest_file_ptr, archive_file_.get(),
-                last_header_.unp_size, last_header_.pack_size, is_compressed);
-        }
-        catch (int e)
+        if (UpdateProgress())
+            throw E_EABORTED;
+    }
+    // Processed synchronously.
+    else
+    {
+        std::vector<char> src_buf;
+        const char* solid_src_data = solid_block_data ? solid_block_data->data() + extra.solid_offset : nullptr;
+        // Packed data is read ahead while this thread decompresses. Cursor ends after it.
+        std::unique_ptr<ReadAheadFile> src_file;
+        if (!solid_src_data && !archive_mapping_.IsOpen() && pipeline_thread_pool_)
         {
-            if (e == E_EABORTED)
-                ::DeleteFileW(full_dest_path.c_str());
-            throw;
+            src_file = std::make_unique<ReadAheadFile>(archive_file_.get(), (uint64_t)header.pack_size,
+                pipeline_thread_pool_.get(), buffer_pool_, *io_buffer_sizer_, kReadAheadChunkCount);
         }
-    }
+        auto read_src = [this, &src_buf, &solid_src_data, &src_file](size_t& size) -> const char*
+        {
+            if (src_file)
+            {
+                // Returns at most the rest of the current chunk, so nothing is copied.
+                const std::span<const char> data = src_file->Peek();
+                if (data.empty())
+                    throw E_EREAD;
+                size = std::min(size, data.size());
+                src_file->Skip(size);
+                return data.data();
+            }
+            if (!solid_src_data)
+                return ReadArchiveData(src_buf, size);
+            const char* ptr = solid_src_data;
+            solid_src_data += size;
+            return ptr;
+        };
+        auto progress = [this](uint64_t bytes) -> bool
+        {
+            bytes_processed_since_previous_progress_ += bytes;
+            return UpdateProgress();
+        };
+        ExtractFileData(full_dest_path, header, extra, dictionary_span, read_src, progress);
 
-    SetFileAttributes(full_dest_path.c_str(), last_header_.attributes);
-    SetFileTime(full_dest_path, last_header_.time);
+        if (UpdateProgress())
+            throw E_EABORTED;
+    }
 
-    if (UpdateBytesProcessedProgress())
-        throw E_EABORTED;
+    // Linear scan continues with the next header. Values from the descriptor are already
+    // in last_header_.
+    if (is_duplicate)
+        SeekArchive((long long)cursor_offset, SEEK_SET);
+    else if (!has_central_directory_ && (header.flags & kEntryFlagDataDescriptor))
+        SeekArchive(sizeof(DataDescriptor), SEEK_CUR);
 }
 
-void ReadingArchive::UnpackFileContent(FILE* dst_file, FILE* src_file,
-    uint64_t dst_file_size, uint64_t src_file_size, bool enable_compression)
+void ReadingArchive::LoadSolidBlock()
 {
-    if (enable_compression)
-    {
-        z_stream zlib_stream;
-        ZeroMemory(&zlib_stream, sizeof(zlib_stream));
-        int zlib_result = inflateInit(&zlib_stream);
-        ZlibResultToWcxException(zlib_result);
-        std::unique_ptr<z_stream, InflateEndDeleter> zlib_stream_ptr(&zlib_stream);
-
-        std::vector<char> src_buf(kBufSize), dst_buf(kBufSize);
-        char* src_buf_ptr = src_buf.data();
-        char* dst_buf_rtr = dst_buf.data();
+    if (last_solid_block_.offset == UINT64_MAX)
+        throw E_BAD_ARCHIVE;
+    if (solid_block_data_offset_ == last_solid_block_.offset)
+        return;
 
-        uint64_t src_bytes_left = src_file_size;
-        uint64_t total_bytes_written = 0;
-        for (;;)
-        {
-            bool made_progress = false;
+    const EntryHeader& header = last_solid_block_.header;
+    const EntryExtra extra = ParseExtraFields(last_solid_block_.extra_fields);
+    if ((header.flags & kEntryFlagCompressed) == 0 && header.unp_size != header.pack_size)
+        throw E_BAD_ARCHIVE;
 
-            // If the source buffer is empty, read more data from the source file.
-            if (zlib_stream.avail_in == 0 && src_bytes_left > 0)
-            {
-                size_t bytes_to_read = (size_t)std::min<uint64_t>(src_bytes_left, kBufSize);
-                size_t bytes_read = fread(src_buf_ptr, 1, bytes_to_read, src_file);
-                if (bytes_read < bytes_to_read)
-                    throw E_EREAD;
-                bytes_processed_since_previous_progress_ += bytes_read;
+    std::shared_ptr<const std::vector<char>> dictionary;
+    if (extra.dictionary_id != 0)
+        dictionary = GetDictionary(extra.dictionary_id);
 
-                zlib_stream.next_in = (Bytef*)src_buf_ptr;
-                zlib_stream.avail_in = (uInt)bytes_read;
-                src_bytes_left -= bytes_read;
-                made_progress = true;
-            }
+    const uint64_t cursor_offset = TellArchive();
+    SeekArchive((long long)(last_solid_block_.offset +
+        GetEntryHeaderSize(header, last_solid_block_.extra_fields.size())), SEEK_SET);
 
-            // Prepare destination buffer.
-            zlib_stream.next_out = (Bytef*)dst_buf_rtr;
-            zlib_stream.avail_out = (uInt)kBufSize;
+    // Jobs still using the previous block keep their own reference to it.
+    auto data = std::make_shared<std::vector<char>>();
+    data->reserve((size_t)header.unp_size);
+    std::vector<char> src_buf;
+    auto write_dst = [&data](const char* ptr, size_t size)
+    {
+        data->insert(data->end(), ptr, ptr + size);
+    };
+    auto read_src = [this, &src_buf](size_t& size) -> const char*
+    {
+        return ReadArchiveData(src_buf, size);
+    };
+    auto progress = [this](uint64_t bytes) -> bool
+    {
+        bytes_processed_since_previous_progress_ += bytes;
+        return UpdateProgress();
+    };
+    uint32_t crc32 = 0;
+    UnpackFileContent(crc32, write_dst, header.unp_size, header.pack_size,
+        (header.flags & kEntryFlagCompressed) != 0, extra.codec,
+        dictionary ? std::span<const char>(*dictionary) : std::span<const char>(), read_src, progress);
+
+    SeekArchive((long long)cursor_offset, SEEK_SET);
+    solid_block_data_ = std::move(data);
+    solid_block_data_offset_ = last_solid_block_.offset;
+}
 
-            // Decompress!
-            zlib_result = inflate(&zlib_stream, 0);
-            if (zlib_result != Z_OK && zlib_result != Z_STREAM_END)
-                ZlibResultToWcxException(zlib_result);
+template<typename ReadSrcFunc, typename ProgressFunc>
+void ReadingArchive::ExtractFileData(const std::wstring& full_dest_path,
+    const EntryHeader& header, const EntryExtra& extra, std::span<const char> dictionary,
+    ReadSrcFunc read_src, ProgressFunc progress)
+{
+    const bool is_compressed = (header.flags & kEntryFlagCompressed) != 0;
+    uint32_t crc32 = 0;
 
-            // If any destination data has been produced, write it to the destination file.
-            if (zlib_stream.avail_out < kBufSize)
-            {
-                size_t bytes_to_write = kBufSize - zlib_stream.avail_out;
-                WriteOrThrow(dst_buf_rtr, 1, bytes_to_write, dst_file);
-                total_bytes_written += bytes_to_write;
-                made_progress = true;
-            }
+    // Test only.
+    if (full_dest_path.empty())
+    {
+        UnpackFileContent(crc32, [](const char*, size_t) { },
+            header.unp_size, header.pack_size, is_compressed, extra.codec, dictionary,
+            read_src, progress);
+        if (extra.has_crc32 && crc32 != extra.crc32)
+            throw E_BAD_DATA;
+        return;
+    }
 
-            if (UpdateBytesProcessedProgress())
+    try
+    {
+        FILE* dest_file_ptr = nullptr;
+        errno_t e = _wfopen_s(&dest_file_ptr, full_dest_path.c_str(), L"wb");
+        if (e != 0)
+            throw E_ECREATE;
+        UniqueFilePtr file(dest_file_ptr);
+        if (progress(0))
+            throw E_EABORTED;
+        if (header.unp_size >= kMinFileSizeForPreallocation)
+            PreallocateFile(dest_file_ptr, header.unp_size);
+
+        if (!is_compressed)
+        {
+            // Stored data is written straight from the archive mapping, solid block or
+            // read-ahead chunk, without copying it to a buffer of the file or a write job.
+            setvbuf(dest_file_ptr, nullptr, _IONBF, 0);
+            auto write_dst = [dest_file_ptr](const char* data, size_t size)
+            {
+                WriteOrThrow(data, 1, size, dest_file_ptr);
+            };
+            UnpackFileContent(crc32, write_dst,
+                header.unp_size, header.pack_size, is_compressed, extra.codec, dictionary,
+                read_src, progress);
+        }
+        else
+        {
+            // Destroyed before the file is closed. File written by a single call doesn't
+            // need a job, which would cost more than it saves.
+            const uint64_t file_size = header.unp_size;
+            WriteBehindFile dst(dest_file_ptr, file_size > kBufSize ? pipeline_thread_pool_.get() : nullptr,
+                buffer_pool_, *io_buffer_sizer_, kMaxPendingWrites);
+            auto write_dst = [this, &dst](const char* data, size_t size)
+            {
+                std::vector<char> buffer = buffer_pool_.Acquire(size);
+                memcpy(buffer.data(), data, size);
+                dst.Write(std::move(buffer));
+            };
+            UnpackFileContent(crc32, write_dst,
+                header.unp_size, header.pack_size, is_compressed, extra.codec, dictionary,
+                read_src, progress);
+            dst.Finish();
+        }
+    }
+    catch (int e)
+    {
+        if (e == E_EABORTED)
+            ::DeleteFileW(full_dest_path.c_str());
+        throw;
+    }
+
+    SetFileAttributes(full_dest_path.c_str(), header.attributes);
+    SetFileTime(full_dest_path, header.time);
+
+    if (extra.has_crc32 && crc32 != extra.crc32)
+        throw E_BAD_DATA;
+}
+
+template<typename WriteDstFunc, typename ReadSrcFunc, typename ProgressFunc>
+void ReadingArchive::UnpackFileContent(uint32_t& out_crc32, WriteDstFunc write_dst,
+    uint64_t dst_file_size, uint64_t src_file_size, bool enable_compression, CodecId codec,
+    std::span<const char> dictionary, ReadSrcFunc read_src, ProgressFunc progress)
+{
+    out_crc32 = 0;
+
+    if (enable_compression)
+    {
+        CodecPool::DecompressorPtr decompressor = codec_pool_.AcquireDecompressor(codec, dictionary);
+
+        // Buffer isn't larger than the unpacked data, so small entries take little memory.
+        const size_t dst_buf_size = io_buffer_sizer_->GetBufferSize(dst_file_size);
+        std::vector<char> dst_buf = buffer_pool_.Acquire(dst_buf_size);
+        char* dst_buf_ptr = dst_buf.data();
+
+        const char* src_ptr = nullptr;
+        size_t src_bytes_available = 0;
+        uint64_t src_bytes_left = src_file_size;
+        uint64_t total_bytes_written = 0;
+        for (;;)
+        {
+            bool made_progress = false;
+            uint64_t bytes_processed = 0;
+
+            // If the source buffer is empty, read more data from the source file.
+            if (src_bytes_available == 0 && src_bytes_left > 0)
+            {
+                size_t bytes_read = io_buffer_sizer_->GetBufferSize(src_bytes_left);
+                src_ptr = read_src(bytes_read);
+                bytes_processed = bytes_read;
+                src_bytes_available = bytes_read;
+                src_bytes_left -= bytes_read;
+                made_progress = true;
+            }
+
+            // Decompress!
+            const size_t bytes_to_write = decompressor->Decompress(
+                src_ptr, src_bytes_available, dst_buf_ptr, dst_buf_size);
+
+            // If any destination data has been produced, write it to the destination file.
+            if (bytes_to_write > 0)
+            {
+                if (bytes_to_write > dst_file_size - total_bytes_written)
+                    throw E_BAD_ARCHIVE;
+                out_crc32 = Crc32(out_crc32, dst_buf_ptr, bytes_to_write);
+                write_dst(dst_buf_ptr, bytes_to_write);
+                total_bytes_written += bytes_to_write;
+                made_progress = true;
+            }
+
+            if (progress(bytes_processed))
                 throw E_EABORTED;
-            if (zlib_result == Z_STREAM_END)
+            if (decompressor->IsFinished())
                 break;
             if (!made_progress)
                 throw E_BAD_ARCHIVE;
@@ -349,27 +1153,46 @@ void ReadingArchive::UnpackFileContent(FILE* dst_file, FILE* src_file,
 
         if (total_bytes_written != dst_file_size)
             throw E_BAD_ARCHIVE;
+        buffer_pool_.Release(std::move(dst_buf));
     }
     else
     {
-        std::vector<char> buf(kBufSize);
-        char* buf_ptr = buf.data();
         uint64_t bytes_left = src_file_size;
         while (bytes_left > 0)
         {
-            size_t bytes_to_process = (size_t)std::min<uint64_t>(bytes_left, kBufSize);
-            size_t bytes_read = fread(buf_ptr, 1, bytes_to_process, src_file);
-            if (bytes_read < bytes_to_process)
-                throw E_EREAD;
-            bytes_processed_since_previous_progress_ += bytes_read;
-            WriteOrThrow(buf_ptr, 1, bytes_read, dst_file);
+            size_t bytes_to_process = (size_t)std::min<uint64_t>(bytes_left, kMaxStoredChunkSize);
+            // Points directly to the mapping, if the archive is mapped.
+            const char* src_ptr = read_src(bytes_to_process);
+            out_crc32 = Crc32(out_crc32, src_ptr, bytes_to_process);
+            write_dst(src_ptr, bytes_to_process);
             bytes_left -= bytes_to_process;
-            if (UpdateBytesProcessedProgress())
+            if (progress(bytes_to_process))
                 throw E_EABORTED;
         }
     }
 }
 
+bool ReadingArchive::UpdateProgress()
+{
+    bytes_processed_since_previous_progress_ += async_bytes_processed_.exchange(0);
+    if (!UpdateBytesProcessedProgress())
+        return false;
+    // Pending extraction jobs stop and delete their partially written files.
+    extraction_cancelled_ = true;
+    return true;
+}
+
+void ReadingArchive::WaitForExtractions(size_t max_pending)
+{
+    while (pending_extractions_.size() > max_pending)
+    {
+        std::future<void> done = std::move(pending_extractions_.front().done);
+        pending_extractions_.pop_front();
+        // Rethrows exception from the job, if any.
+        done.get();
+    }
+}
+
 void ReadingArchive::SetFileTime(const wstr_view& file_path, uint32_t file_time)
 {
     HANDLE file_handle = CreateFileW(
@@ -400,107 +1223,193 @@ void ReadingArchive::SetFileTime(const wstr_view& file_path, uint32_t file_time)
     ::SetFileTime(file_handle, &winapi_file_time, &winapi_file_time, &winapi_file_time);
 }
 
-void PackingArchive::WriteEntryHeader(const EntryHeader& header, const wstr_view& path)
+void PackingArchive::WriteEntryHeader(const EntryHeader& header, const wstr_view& path,
+    const std::vector<char>& extra_fields)
 {
-    if(header.attributes & FILE_ATTR_DIRECTORY)
-        assert(header.pack_size == 0);
+    header_buf_.clear();
+    AppendEntryHeader(header_buf_, header, path, extra_fields);
+    WriteOrThrow(header_buf_.data(), 1, header_buf_.size(), archive_file_.get());
+}
 
-    FILE* archive_file_ptr = archive_file_.get();
-    WriteOrThrow(&header, sizeof(header), 1, archive_file_ptr);
-    WriteOrThrow(path.data(), sizeof(wchar_t), path.length(), archive_file_ptr);
+// Parallel compression produces zlib stream without a dictionary.
+static bool UseParallelCompression(uint64_t src_file_size, bool enable_compression, CodecId codec)
+{
+    return enable_compression && codec == kCodecZlib && kEnableParallelCompression &&
+        src_file_size >= kMinFileSizeForParallelCompression &&
+        std::thread::hardware_concurrency() > 1;
+}
+
+// Returns distance between seek points of a compressed file, or 0 if it has none.
+static uint64_t GetSeekPointInterval(uint64_t src_file_size)
+{
+    if(!kEnableSeekPoints || src_file_size <= kMinSeekPointInterval)
+        return 0;
+    const uint64_t interval = std::max(kMinSeekPointInterval, src_file_size / (kMaxSeekPoints + 1) + 1);
+    // Rounded up, so seek points are at boundaries of blocks of parallel compression.
+    return (interval + kParallelCompressionBlockSize - 1) / kParallelCompressionBlockSize * kParallelCompressionBlockSize;
+}
+
+// Returns number of seek points of a file, which are at multiples of seek_interval before its end.
+static size_t GetSeekPointCount(uint64_t src_file_size, uint64_t seek_interval)
+{
+    return seek_interval != 0 ? (size_t)((src_file_size - 1) / seek_interval) : 0;
 }
 
 void PackingArchive::PackFileContent(
-    uint64_t& out_bytes_written, uint64_t& out_bytes_read,
-    FILE* dst_file, FILE* src_file, uint64_t src_file_size, bool enable_compression)
+    uint64_t& out_bytes_written, uint64_t& out_bytes_read, uint32_t& out_crc32,
+    uint64_t& out_content_hash, std::vector<uint64_t>& out_seek_offsets,
+    FILE* dst_file, ReadAheadFile& src_file, uint64_t src_file_size, bool enable_compression, CodecId codec,
+    std::span<const char> dictionary, uint64_t seek_interval)
 {
     out_bytes_written = 0;
     out_bytes_read = 0;
+    out_crc32 = 0;
+    out_seek_offsets.clear();
+    if(!enable_compression)
+        seek_interval = 0;
+    ContentHasher content_hasher;
 
-    if(enable_compression)
+    if(UseParallelCompression(src_file_size, enable_compression, codec))
     {
-        z_stream zlib_stream;
-        ZeroMemory(&zlib_stream, sizeof(zlib_stream));
-        int zlib_result = deflateInit(&zlib_stream, Z_DEFAULT_COMPRESSION);
-        ZlibResultToWcxException(zlib_result);
-        std::unique_ptr<z_stream, DeflateEndDeleter> zlib_stream_ptr(&zlib_stream);
-
-        std::vector<char> src_buf(kBufSize), dstBuf(kBufSize);
-        char* src_buf_ptr = src_buf.data();
-        char* dst_buf_ptr = dstBuf.data();
-
-        bool is_src_end = false;
-        for(;;)
+        assert(dictionary.empty());
+        PackFileContentParallel(out_bytes_written, out_bytes_read, out_crc32, content_hasher, out_seek_offsets,
+            dst_file, src_file, src_file_size, seek_interval);
+    }
+    else
+    {
+        // Source file is read ahead and the archive written behind on pipeline threads,
+        // so this thread only compresses.
+        WriteBehindFile dst(dst_file, pipeline_thread_pool_.get(), buffer_pool_, *io_buffer_sizer_, kMaxPendingWrites);
+        CodecPool::CompressorPtr compressor(nullptr, CodecPool::Releaser{&codec_pool_});
+        if(enable_compression)
+            compressor = codec_pool_.AcquireCompressor(codec, dictionary);
+
+        const size_t seek_point_count = GetSeekPointCount(src_file_size, seek_interval);
+        for(bool is_src_end = false; !is_src_end; )
         {
-            bool made_progress = false;
-
-            // If the source buffer is empty, read more data from the source file.
-            if(zlib_stream.avail_in == 0 && !is_src_end)
+            std::span<const char> src_data = src_file.Peek();
+            is_src_end = src_data.empty();
+            // Data is passed to the compressor up to the next seek point, where it is flushed.
+            const uint64_t next_seek_point = (out_seek_offsets.size() + 1) * seek_interval;
+            const bool reaches_seek_point = out_seek_offsets.size() < seek_point_count &&
+                src_data.size() >= next_seek_point - out_bytes_read;
+            if(reaches_seek_point)
+                src_data = src_data.first((size_t)(next_seek_point - out_bytes_read));
+            out_bytes_read += src_data.size();
+            out_crc32 = Crc32(out_crc32, src_data.data(), src_data.size());
+            content_hasher.Update(src_data.data(), src_data.size());
+
+            std::vector<char> dst_buf;
+            if(compressor)
             {
-                size_t bytes_read = fread(src_buf_ptr, 1, kBufSize, src_file);
-                if(bytes_read < kBufSize)
+                dst_buf = buffer_pool_.Acquire(0);
+                compressor->Compress(dst_buf, src_data.data(), src_data.size(), is_src_end);
+                if(reaches_seek_point)
                 {
-                    if(feof(src_file))
-                        is_src_end = true;
-                    else
-                        throw E_EREAD;
+                    compressor->Flush(dst_buf);
+                    out_seek_offsets.push_back(out_bytes_written + dst_buf.size());
                 }
-                zlib_stream.next_in = (Bytef*)src_buf_ptr;
-                zlib_stream.avail_in = (uInt)bytes_read;
-                out_bytes_read += bytes_read;
-                made_progress = true;
             }
-
-            // Prepare destination buffer.
-            zlib_stream.next_out = (Bytef*)dst_buf_ptr;
-            zlib_stream.avail_out = (uInt)kBufSize;
-                
-            // Compress!
-            zlib_result = deflate(&zlib_stream, is_src_end ? Z_FINISH : Z_NO_FLUSH);
-            if(zlib_result != Z_OK && zlib_result != Z_STREAM_END)
-                ZlibResultToWcxException(zlib_result);
-
-            // If any destination data has been produced, write it to the destination file.
-            if(zlib_stream.avail_out < kBufSize)
+            else
             {
-                size_t bytes_to_write = kBufSize - zlib_stream.avail_out;
-                WriteOrThrow(dst_buf_ptr, 1, bytes_to_write, dst_file);
-                out_bytes_written += bytes_to_write;
-                made_progress = true;
+                dst_buf = buffer_pool_.Acquire(src_data.size());
+                memcpy(dst_buf.data(), src_data.data(), src_data.size());
             }
+            src_file.Skip(src_data.size());
 
-            if(zlib_result == Z_STREAM_END)
-                break;
-            if(!made_progress)
-                throw E_BAD_ARCHIVE;
-        }
-    }
-    else
-    {
-        if(src_file_size == 0)
-            return;
-
-        std::vector<char> buf(kBufSize);
-        char* buf_ptr = buf.data();
-        size_t bytes_read = 0;
-        do
-        {
-            bytes_read = fread(buf_ptr, 1, kBufSize, src_file);
-            if(bytes_read < kBufSize && !feof(src_file))
-                throw E_EREAD;
-
-            if(bytes_read)
+            // If any destination data has been produced, pass it to the writer.
+            if(!dst_buf.empty())
             {
-                WriteOrThrow(buf_ptr, 1, bytes_read, dst_file);
-                out_bytes_read += bytes_read;
+                out_bytes_written += dst_buf.size();
+                dst.Write(std::move(dst_buf));
             }
+            else
+                buffer_pool_.Release(std::move(dst_buf));
         }
-        while(bytes_read == kBufSize);
-        out_bytes_written = out_bytes_read;
+        dst.Finish();
     }
 
     if(out_bytes_read != src_file_size)
         throw E_EREAD;
+    out_content_hash = content_hasher.Finish();
+}
+
+void PackingArchive::PackFileContentParallel(
+    uint64_t& out_bytes_written, uint64_t& out_bytes_read, uint32_t& out_crc32,
+    ContentHasher& content_hasher, std::vector<uint64_t>& out_seek_offsets,
+    FILE* dst_file, ReadAheadFile& src_file, uint64_t src_file_size, uint64_t seek_interval)
+{
+    assert(seek_interval % kParallelCompressionBlockSize == 0);
+    if(!thread_pool_)
+        thread_pool_ = std::make_unique<ThreadPool>();
+    // Limits memory usage while keeping all threads busy.
+    const size_t max_blocks_in_flight = thread_pool_->GetThreadCount() * 2;
+
+    // zlib header: CMF = deflate with 32 KB window, FLG = default compression level, no dictionary.
+    const uint8_t zlib_header[] = { 0x78, 0x9C };
+    WriteOrThrow(zlib_header, 1, sizeof(zlib_header), dst_file);
+    out_bytes_written += sizeof(zlib_header);
+
+    uLong adler = adler32(0, nullptr, 0);
+    std::deque<std::shared_ptr<ParallelDeflateBlock>> blocks;
+
+    // Writes the oldest block, waiting for its compression to finish.
+    auto write_front_block = [&]()
+    {
+        // Rethrows exception from the job, if any.
+        blocks.front()->done.get();
+        const ParallelDeflateBlock& block = *blocks.front();
+        // Previous block ended byte-aligned and this one doesn't reference it.
+        if(block.is_seek_point)
+            out_seek_offsets.push_back(out_bytes_written);
+        WriteOrThrow(block.dst.data(), 1, block.dst.size(), dst_file);
+        out_bytes_written += block.dst.size();
+        adler = adler32_combine(adler, block.adler, (z_off_t)block.src.size());
+        out_crc32 = (uint32_t)crc32_combine(out_crc32, block.crc32, (z_off_t)block.src.size());
+        blocks.pop_front();
+    };
+
+    std::shared_ptr<ParallelDeflateBlock> prev_block;
+    uint64_t src_bytes_left = src_file_size;
+    while(src_bytes_left > 0)
+    {
+        auto block = std::make_shared<ParallelDeflateBlock>();
+        const size_t block_size = (size_t)std::min<uint64_t>(src_bytes_left, kParallelCompressionBlockSize);
+        block->src.resize(block_size);
+        if(src_file.Read(block->src.data(), block_size) != block_size)
+            throw E_EREAD;
+        content_hasher.Update(block->src.data(), block_size);
+        block->is_seek_point = seek_interval != 0 && out_bytes_read != 0 && out_bytes_read % seek_interval == 0;
+        out_bytes_read += block_size;
+        src_bytes_left -= block_size;
+        block->is_last = src_bytes_left == 0;
+
+        if(prev_block && !block->is_seek_point)
+        {
+            const size_t dictionary_size = std::min(prev_block->src.size(), kDeflateWindowSize);
+            block->dictionary.assign(prev_block->src.end() - dictionary_size, prev_block->src.end());
+        }
+
+        // Job holds its own reference, so the block stays alive even if this function throws.
+        block->done = thread_pool_->Submit([this, block]() { DeflateBlock(*block, codec_pool_); });
+        blocks.push_back(block);
+        prev_block = std::move(block);
+
+        if(blocks.size() >= max_blocks_in_flight)
+            write_front_block();
+    }
+    prev_block.reset();
+
+    while(!blocks.empty())
+        write_front_block();
+
+    uint8_t zlib_trailer[4];
+    zlib_trailer[0] = (uint8_t)(adler >> 24);
+    zlib_trailer[1] = (uint8_t)(adler >> 16);
+    zlib_trailer[2] = (uint8_t)(adler >> 8);
+    zlib_trailer[3] = (uint8_t)adler;
+    WriteOrThrow(zlib_trailer, 1, sizeof(zlib_trailer), dst_file);
+    out_bytes_written += sizeof(zlib_trailer);
 }
 
 void PackingArchive::GetFileAttributes(EntryHeader& header, const wstr_view& full_path)
@@ -518,33 +1427,7 @@ void PackingArchive::GetFileAttributes(EntryHeader& header, const wstr_view& ful
         header.unp_size = windows_attr.nFileSizeLow | ((uint64_t)windows_attr.nFileSizeHigh << 32);
 
     header.attributes = WindowsAttributesToWcxAttributes(windows_attr.dwFileAttributes);
-
-    FILETIME local_time;
-    b = FileTimeToLocalFileTime(&windows_attr.ftLastWriteTime, &local_time);
-    if(!b)
-        throw E_UNKNOWN_FORMAT;
-    WORD dos_date, dos_time;
-    b = FileTimeToDosDateTime(&local_time, &dos_date, &dos_time);
-    if(!b)
-        throw E_UNKNOWN_FORMAT;
-    header.time = ((uint32_t)dos_date << 16) | (uint32_t)dos_time;
-}
-
-bool DeletingArchive::ShouldDelete(const wstr_view& curr_path, std::span<const std::wstring> paths_to_delete)
-{
-    auto final_curr_path = curr_path.to_string();
-    UpperCase(final_curr_path);
-
-    while(!final_curr_path.empty())
-    {
-        const auto it = std::lower_bound(
-            paths_to_delete.begin(), paths_to_delete.end(), final_curr_path);
-        if(it != paths_to_delete.end() && *it == final_curr_path)
-            return true;
-        UpDir(final_curr_path);
-    }
-
-    return false;
+    header.time = FileTimeToWcxTime(windows_attr.ftLastWriteTime);
 }
 
 uint64_t ArchiveBase::GetFileSize(FILE* f)
@@ -592,12 +1475,73 @@ bool ArchiveBase::UpdateDirectProgress(wchar_t* file_name, int size)
     return false;
 }
 
+size_t ArchiveBase::ReadArchive(void* dst_buf, size_t size)
+{
+    if (!archive_mapping_.IsOpen())
+        return fread(dst_buf, 1, size, archive_file_.get());
+
+    const uint64_t mapping_size = archive_mapping_.GetSize();
+    if (mapped_offset_ >= mapping_size)
+        return 0;
+    const size_t bytes_read = (size_t)std::min<uint64_t>(size, mapping_size - mapped_offset_);
+    memcpy(dst_buf, archive_mapping_.GetData() + mapped_offset_, bytes_read);
+    mapped_offset_ += bytes_read;
+    return bytes_read;
+}
+
+const char* ArchiveBase::ReadArchiveData(std::vector<char>& tmp_buf, size_t size)
+{
+    if (!archive_mapping_.IsOpen())
+    {
+        if (tmp_buf.size() < size)
+            tmp_buf.resize(size);
+        ReadOrThrow(tmp_buf.data(), 1, size, archive_file_.get());
+        return tmp_buf.data();
+    }
+
+    const uint64_t mapping_size = archive_mapping_.GetSize();
+    if (mapped_offset_ > mapping_size || size > mapping_size - mapped_offset_)
+        throw E_EREAD;
+    const char* ptr = archive_mapping_.GetData() + mapped_offset_;
+    mapped_offset_ += size;
+    return ptr;
+}
+
+void ArchiveBase::SeekArchive(int64_t offset, int origin)
+{
+    if (!archive_mapping_.IsOpen())
+    {
+        SeekOrThrow(archive_file_.get(), offset, origin);
+        return;
+    }
+
+    int64_t base = 0;
+    if (origin == SEEK_CUR)
+        base = (int64_t)mapped_offset_;
+    else if (origin == SEEK_END)
+        base = (int64_t)archive_mapping_.GetSize();
+    // Like with fseek, seeking past the end is allowed, but reading there fails.
+    if (base + offset < 0)
+        throw E_NOT_SUPPORTED;
+    mapped_offset_ = (uint64_t)(base + offset);
+}
+
+uint64_t ArchiveBase::TellArchive()
+{
+    if (archive_mapping_.IsOpen())
+        return mapped_offset_;
+    return (uint64_t)_ftelli64(archive_file_.get());
+}
+
 void ArchiveBase::ReadAndCheckHeader()
 {
     constexpr size_t header_len = kFileHeader.size();
     char header[header_len];
-    ReadOrThrow(header, 1, header_len, archive_file_.get());
-    if (memcmp(kFileHeader.data(), header, header_len) != 0)
+    if (ReadArchive(header, header_len) != header_len)
+        throw E_EREAD;
+    static_assert(kFileHeaderV100.size() == header_len);
+    old_file_header_ = memcmp(kFileHeaderV100.data(), header, header_len) == 0;
+    if (!old_file_header_ && memcmp(kFileHeader.data(), header, header_len) != 0)
         throw E_BAD_ARCHIVE;
     bytes_processed_since_previous_progress_ += header_len;
 }
@@ -605,10 +1549,8 @@ void ArchiveBase::ReadAndCheckHeader()
 bool ArchiveBase::ReadEntryHeader()
 {
     last_header_ = EntryHeader{};
-    FILE* const archive_file_ptr = archive_file_.get();
 
-    size_t read_count = fread(&last_header_, sizeof(last_header_), 1, archive_file_ptr);
-    if(read_count == 0)
+    if(ReadArchive(&last_header_, sizeof(last_header_)) != sizeof(last_header_))
         return false;
     if (last_header_.magic != kEntryMagic)
         throw E_BAD_ARCHIVE;
@@ -620,13 +1562,443 @@ bool ArchiveBase::ReadEntryHeader()
     if (path_len > kMaxFileNameLen - 1)
         throw E_SMALL_BUF;
     wchar_t name_buf[kMaxFileNameLen];
-    ReadOrThrow(name_buf, sizeof(wchar_t), path_len, archive_file_ptr);
+    if(ReadArchive(name_buf, path_len * sizeof(wchar_t)) != path_len * sizeof(wchar_t))
+        throw E_EREAD;
     bytes_processed_since_previous_progress_ += path_len;
     last_header_path_.assign(name_buf, name_buf + path_len);
 
+    last_header_extra_fields_.clear();
+    if (last_header_.flags & kEntryFlagExtraFields)
+    {
+        uint16_t extra_fields_size = 0;
+        if (ReadArchive(&extra_fields_size, sizeof(extra_fields_size)) != sizeof(extra_fields_size))
+            throw E_EREAD;
+        last_header_extra_fields_.resize(extra_fields_size);
+        if (ReadArchive(last_header_extra_fields_.data(), extra_fields_size) != extra_fields_size)
+            throw E_EREAD;
+        bytes_processed_since_previous_progress_ += sizeof(extra_fields_size) + extra_fields_size;
+    }
+
+    if (last_header_.flags & kEntryFlagDataDescriptor)
+        ReadDataDescriptor();
+
     return true;
 }
 
+void ArchiveBase::ReadDataDescriptor()
+{
+    const uint64_t data_offset = TellArchive();
+    DataDescriptor descriptor = {};
+    if ((last_header_.flags & kEntryFlagCompressed) == 0)
+    {
+        // Stored data has the size of the file.
+        SeekArchive((long long)last_header_.unp_size, SEEK_CUR);
+        if (ReadArchive(&descriptor, sizeof(descriptor)) != sizeof(descriptor))
+            throw E_EREAD;
+        if (descriptor.magic != kDataDescriptorMagic || descriptor.pack_size != last_header_.unp_size ||
+            descriptor.unp_size != last_header_.unp_size)
+            throw E_BAD_ARCHIVE;
+    }
+    else
+    {
+        // Compressed data is searched for the magic. Only a descriptor with pack_size equal to
+        // its own offset, followed by the next entry or the end of the archive, is accepted,
+        // so the magic occurring inside the data is passed over.
+        std::vector<char> buf(kBufSize);
+        size_t buf_size = 0;
+        // Offset of buf[0] from data_offset.
+        uint64_t buf_offset = 0;
+        bool archive_end = false;
+        bool found = false;
+        while (!found)
+        {
+            if (archive_end)
+                throw E_BAD_ARCHIVE;
+            const size_t bytes_read = ReadArchive(buf.data() + buf_size, buf.size() - buf_size);
+            archive_end = bytes_read == 0;
+            buf_size += bytes_read;
+            size_t pos = 0;
+            for (; pos + sizeof(descriptor) <= buf_size; ++pos)
+            {
+                const char* ptr = (const char*)memchr(buf.data() + pos, (char)(kDataDescriptorMagic & 0xFF),
+                    buf_size - sizeof(descriptor) + 1 - pos);
+                if (!ptr)
+                {
+                    pos = buf_size - sizeof(descriptor) + 1;
+                    break;
+                }
+                pos = ptr - buf.data();
+                memcpy(&descriptor, ptr, sizeof(descriptor));
+                if (descriptor.magic != kDataDescriptorMagic || descriptor.pack_size != buf_offset + pos)
+                    continue;
+                const size_t next_pos = pos + sizeof(descriptor);
+                if (next_pos + sizeof(kEntryMagic) <= buf_size)
+                {
+                    uint32_t next_magic = 0;
+                    memcpy(&next_magic, buf.data() + next_pos, sizeof(next_magic));
+                    found = next_magic == kEntryMagic;
+                }
+                else if (archive_end)
+                    found = next_pos == buf_size;
+                else
+                    // Checked again when more data is read.
+                    break;
+                if (found)
+                    break;
+            }
+            // Unchecked tail is kept for the next read.
+            memmove(buf.data(), buf.data() + pos, buf_size - pos);
+            buf_size -= pos;
+            buf_offset += pos;
+        }
+    }
+    SeekArchive((long long)data_offset, SEEK_SET);
+
+    last_header_.pack_size = descriptor.pack_size;
+    last_header_.unp_size = descriptor.unp_size;
+    SetExtraFieldCrc32(last_header_extra_fields_, descriptor.crc32);
+}
+
+bool ArchiveBase::ReadCentralDirectory()
+{
+    const uint64_t cursor_offset = TellArchive();
+
+    index_.clear();
+    has_central_directory_ = false;
+
+    SeekArchive(0, SEEK_END);
+    const uint64_t file_size = TellArchive();
+    data_end_offset_ = file_size;
+
+    if(file_size >= kFileHeader.size() + sizeof(EntryHeader) + sizeof(CentralDirectoryTrailer))
+    {
+        CentralDirectoryTrailer trailer = {};
+        SeekArchive(-(long long)sizeof(trailer), SEEK_END);
+        if(ReadArchive(&trailer, sizeof(trailer)) != sizeof(trailer))
+            throw E_EREAD;
+
+        if(trailer.magic == kCentralDirectoryMagic &&
+            trailer.entry_offset >= kFileHeader.size() &&
+            trailer.entry_offset < file_size)
+        {
+            SeekArchive((long long)trailer.entry_offset, SEEK_SET);
+            bool header_valid = false;
+            try
+            {
+                header_valid = ReadEntryHeader() &&
+                    (last_header_.flags & kEntryFlagCentralDirectory) != 0 &&
+                    TellArchive() + last_header_.pack_size == file_size;
+            }
+            catch(int)
+            {
+                // Not a valid entry header - fall back to linear scan.
+            }
+
+            if(header_valid)
+            {
+                // Whole central directory is loaded with one read.
+                std::vector<char> buf;
+                const size_t size = (size_t)last_header_.pack_size;
+                const char* ptr = ReadArchiveData(buf, size);
+                const char* const end = ptr + size - sizeof(CentralDirectoryTrailer);
+                bool records_valid = true;
+                while(ptr < end && records_valid)
+                {
+                    IndexEntry entry = {};
+                    if((size_t)(end - ptr) < sizeof(entry.offset) + sizeof(entry.header))
+                    {
+                        records_valid = false;
+                        break;
+                    }
+                    memcpy(&entry.offset, ptr, sizeof(entry.offset));
+                    ptr += sizeof(entry.offset);
+                    memcpy(&entry.header, ptr, sizeof(entry.header));
+                    ptr += sizeof(entry.header);
+
+                    const size_t path_bytes = entry.header.path_len * sizeof(wchar_t);
+                    records_valid = entry.header.magic == kEntryMagic &&
+                        entry.header.path_len > 0 &&
+                        entry.header.path_len <= kMaxFileNameLen - 1 &&
+                        (size_t)(end - ptr) >= path_bytes;
+                    if(!records_valid)
+                        break;
+                    entry.path.resize(entry.header.path_len);
+                    memcpy(entry.path.data(), ptr, path_bytes);
+                    ptr += path_bytes;
+
+                    if(entry.header.flags & kEntryFlagExtraFields)
+                    {
+                        uint16_t extra_fields_size = 0;
+                        records_valid = (size_t)(end - ptr) >= sizeof(extra_fields_size);
+                        if(!records_valid)
+                            break;
+                        memcpy(&extra_fields_size, ptr, sizeof(extra_fields_size));
+                        ptr += sizeof(extra_fields_size);
+                        records_valid = (size_t)(end - ptr) >= extra_fields_size;
+                        if(!records_valid)
+                            break;
+                        entry.extra_fields.assign(ptr, ptr + extra_fields_size);
+                        ptr += extra_fields_size;
+                    }
+
+                    records_valid = entry.offset + GetEntrySize(entry) <= trailer.entry_offset;
+                    if(records_valid)
+                        index_.push_back(std::move(entry));
+                }
+
+                if(records_valid && ptr == end && index_.size() == trailer.record_count)
+                {
+                    has_central_directory_ = true;
+                    data_end_offset_ = trailer.entry_offset;
+                }
+                else
+                    index_.clear();
+            }
+            last_header_ = EntryHeader{};
+            last_header_path_.clear();
+            last_header_extra_fields_.clear();
+        }
+    }
+
+    SeekArchive((long long)cursor_offset, SEEK_SET);
+    return has_central_directory_;
+}
+
+void ArchiveBase::WriteCentralDirectory()
+{
+    FILE* const archive_file_ptr = archive_file_.get();
+
+    if(!kEnableCentralDirectory)
+    {
+        // Don't leave a directory that no longer matches the entries.
+        if(has_central_directory_)
+            TruncateOrThrow(archive_file_ptr, data_end_offset_);
+        return;
+    }
+
+    std::vector<char> buf;
+    AppendCentralDirectory(buf, index_, data_end_offset_);
+    SeekOrThrow(archive_file_ptr, (long long)data_end_offset_, SEEK_SET);
+    WriteOrThrow(buf.data(), 1, buf.size(), archive_file_ptr);
+    TruncateOrThrow(archive_file_ptr, (uint64_t)_ftelli64(archive_file_ptr));
+    has_central_directory_ = true;
+}
+
+void ArchiveBase::MarkEntriesDeleted(std::vector<size_t> entry_indices)
+{
+    if(entry_indices.empty())
+        return;
+
+    // index_ is in file order, but sorting doesn't rely on it.
+    std::sort(entry_indices.begin(), entry_indices.end(), [this](size_t a, size_t b)
+        {
+            return index_[a].offset < index_[b].offset;
+        });
+
+    FILE* const archive_file_ptr = archive_file_.get();
+    for(size_t i : entry_indices)
+    {
+        IndexEntry& entry = index_[i];
+        // Set offset to Flags.
+        SeekOrThrow(archive_file_ptr, (long long)entry.offset +
+            sizeof(uint32_t), // For Magic.
+            SEEK_SET);
+        // Write new flags.
+        entry.header.flags |= kEntryFlagDeleted;
+        WriteOrThrow(&entry.header.flags, sizeof(entry.header.flags), 1, archive_file_ptr);
+    }
+}
+
+void ArchiveBase::MarkUnusedSolidBlocksDeleted()
+{
+    std::vector<size_t> unused_blocks;
+    size_t block = SIZE_MAX;
+    bool block_used = false;
+    for(size_t i = 0, count = index_.size(); i < count; ++i)
+    {
+        const IndexEntry& entry = index_[i];
+        if(entry.header.flags & kEntryFlagDeleted)
+            continue;
+        if(entry.header.flags & kEntryFlagSolidBlock)
+        {
+            if(block != SIZE_MAX && !block_used)
+                unused_blocks.push_back(block);
+            block = i;
+            block_used = false;
+        }
+        else if(entry.header.flags & kEntryFlagSolid)
+            block_used = true;
+    }
+    if(block != SIZE_MAX && !block_used)
+        unused_blocks.push_back(block);
+    MarkEntriesDeleted(std::move(unused_blocks));
+}
+
+std::vector<bool> ArchiveBase::FindDeletedEntriesInUse() const
+{
+    std::vector<bool> in_use(index_.size());
+
+    // Content hashes referred to by duplicates, with unp_size and CRC-32.
+    struct Reference
+    {
+        uint64_t unp_size;
+        uint32_t crc32;
+    };
+    std::unordered_multimap<uint64_t, Reference> references;
+    for(const IndexEntry& entry : index_)
+    {
+        if((entry.header.flags & (kEntryFlagDeleted | kEntryFlagExtraFields)) != kEntryFlagExtraFields)
+            continue;
+        const EntryExtra extra = ParseExtraFields(entry.extra_fields);
+        if(extra.duplicate_of != 0)
+            references.emplace(extra.duplicate_of, Reference{entry.header.unp_size, extra.crc32});
+    }
+    if(references.empty())
+        return in_use;
+
+    for(size_t i = 0, count = index_.size(); i < count; ++i)
+    {
+        const IndexEntry& entry = index_[i];
+        if((entry.header.flags & kEntryFlagDeleted) == 0)
+            continue;
+        const uint64_t content_hash = GetContentHash(entry.header, entry.extra_fields);
+        if(content_hash == 0)
+            continue;
+        const uint32_t crc32 = ParseExtraFields(entry.extra_fields).crc32;
+        auto [begin, end] = references.equal_range(content_hash);
+        in_use[i] = std::any_of(begin, end, [&entry, crc32](const auto& reference)
+            {
+                return reference.second.unp_size == entry.header.unp_size && reference.second.crc32 == crc32;
+            });
+    }
+    return in_use;
+}
+
+// Writes deleted entry covering size bytes at offset. size is at least
+// kFreeSpaceEntryMinSize. Returns the entry for index_.
+static IndexEntry WriteFreeSpaceEntry(FILE* file, uint64_t offset, uint64_t size)
+{
+    assert(size >= kFreeSpaceEntryMinSize);
+    IndexEntry free_space = {};
+    free_space.offset = offset;
+    free_space.header.magic = kEntryMagic;
+    free_space.header.flags = kEntryFlagDeleted;
+    free_space.header.path_len = (uint16_t)kFreeSpacePath.length();
+    free_space.header.pack_size = size - kFreeSpaceEntryMinSize;
+    free_space.header.unp_size = free_space.header.pack_size;
+    free_space.path = kFreeSpacePath;
+    SeekOrThrow(file, (long long)offset, SEEK_SET);
+    WriteOrThrow(&free_space.header, sizeof(free_space.header), 1, file);
+    WriteOrThrow(kFreeSpacePath.data(), sizeof(wchar_t), kFreeSpacePath.length(), file);
+    return free_space;
+}
+
+bool ArchiveBase::ShouldCompact() const
+{
+    if(!kEnableCompaction || data_end_offset_ <= kFileHeader.size())
+        return false;
+
+    // Deleted entries holding data of duplicates are not reclaimed by Compact.
+    const std::vector<bool> deleted_in_use = FindDeletedEntriesInUse();
+    uint64_t live_bytes = 0;
+    for(size_t i = 0, count = index_.size(); i < count; ++i)
+    {
+        const IndexEntry& entry = index_[i];
+        if((entry.header.flags & kEntryFlagDeleted) == 0 || deleted_in_use[i])
+            live_bytes += GetEntrySize(entry);
+    }
+    // Includes stale central directories, which are not in index_.
+    const uint64_t total_bytes = data_end_offset_ - kFileHeader.size();
+    const uint64_t deleted_bytes = total_bytes - live_bytes;
+    return deleted_bytes > 0 &&
+        (double)deleted_bytes >= (double)total_bytes * kMinDeletedRatioForCompaction;
+}
+
+void ArchiveBase::Compact(const wstr_view& archive_path)
+{
+    const std::wstring temp_path = archive_path.to_string() + std::wstring(kCompactionTempFileSuffix);
+    FILE* f = nullptr;
+    if(_wfopen_s(&f, temp_path.c_str(), L"wb") != 0)
+        return;
+    UniqueFilePtr temp_file(f);
+
+    const std::vector<bool> deleted_in_use = FindDeletedEntriesInUse();
+    std::vector<IndexEntry> compacted;
+    compacted.reserve(index_.size());
+    uint64_t dst_offset = kFileHeader.size();
+    try
+    {
+        FILE* const archive_file_ptr = archive_file_.get();
+        const std::string_view file_header = old_file_header_ ? kFileHeaderV100 : kFileHeader;
+        WriteOrThrow(file_header.data(), 1, file_header.size(), temp_file.get());
+        std::vector<char> buf(kCompactionBufSize);
+        // Adjacent entries are read without seeking.
+        uint64_t src_offset = UINT64_MAX;
+        for(size_t i = 0, count = index_.size(); i < count; ++i)
+        {
+            const IndexEntry& entry = index_[i];
+            // Kept deleted entries stay deleted. Their order relative to duplicates is preserved.
+            if((entry.header.flags & kEntryFlagDeleted) && !deleted_in_use[i])
+                continue;
+
+            const uint64_t entry_size = GetEntrySize(entry);
+            if(entry.offset != src_offset)
+                SeekOrThrow(archive_file_ptr, (long long)entry.offset, SEEK_SET);
+            for(uint64_t copied = 0; copied < entry_size; )
+            {
+                const size_t chunk_size = (size_t)std::min<uint64_t>(buf.size(), entry_size - copied);
+                ReadOrThrow(buf.data(), 1, chunk_size, archive_file_ptr);
+                WriteOrThrow(buf.data(), 1, chunk_size, temp_file.get());
+                copied += chunk_size;
+            }
+            src_offset = entry.offset + entry_size;
+            compacted.push_back(entry);
+            compacted.back().offset = dst_offset;
+            dst_offset += entry_size;
+
+            int progress = -(int)CalcPercent(src_offset, data_end_offset_);
+            if(UpdateDirectProgress(nullptr, progress))
+                throw E_EABORTED;
+        }
+        // Archive has a matching central directory as soon as it is replaced.
+        if(kEnableCentralDirectory)
+        {
+            buf.clear();
+            AppendCentralDirectory(buf, compacted, dst_offset);
+            WriteOrThrow(buf.data(), 1, buf.size(), temp_file.get());
+        }
+        if(fclose(temp_file.release()) != 0)
+            throw E_EWRITE;
+    }
+    catch(int error)
+    {
+        temp_file.reset();
+        ::DeleteFileW(temp_path.c_str());
+        if(error != E_EABORTED)
+            // E.g. not enough disk space for the copy. Archive stays as it is.
+            return;
+        // Deleted flags are already written to entry headers.
+        WriteCentralDirectory();
+        throw;
+    }
+
+    archive_file_.reset();
+    const bool replaced = ::MoveFileExW(temp_path.c_str(), archive_path.c_str(),
+        MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != FALSE;
+    if(!replaced)
+        ::DeleteFileW(temp_path.c_str());
+    if(_wfopen_s(&f, archive_path.c_str(), L"r+b") != 0)
+        throw E_EOPEN;
+    archive_file_.reset(f);
+    if(replaced)
+    {
+        index_ = std::move(compacted);
+        data_end_offset_ = dst_offset;
+        has_central_directory_ = kEnableCentralDirectory;
+    }
+    SeekOrThrow(archive_file_.get(), (long long)data_end_offset_, SEEK_SET);
+}
+
 int PackingArchive::PackFilesW(wchar_t* packedFile, wchar_t* subPath, wchar_t* srcPath,
     wchar_t* addList, int flags)
 {
@@ -641,113 +2013,561 @@ int PackingArchive::PackFilesW(wchar_t* packedFile, wchar_t* subPath, wchar_t* s
 
     According to my experiments with ZIP format, in this mode:
 
-    - subPath should still work - files should be packed into indicated subdirectory
-    in the archive.
-    - New directories in the archive should not be created, only files, all on the
-    same level.
-    - When delete_source_files == true, source directories should not be deleted, only
-    files.
-    */
+    - subPath should still work - files should be packed into indicated subdirectory
+    in the archive.
+    - New directories in the archive should not be created, only files, all on the
+    same level.
+    - When delete_source_files == true, source directories should not be deleted, only
+    files.
+    */
+
+    if(CallProcessDataProc(packedFile, 0) == 0)
+        throw E_EABORTED;
+    last_progress_time_ = GetTickCount64();
+
+    auto relative_paths_to_add = ParseStringList(addList);
+
+    for(size_t i = relative_paths_to_add.size(); i--; )
+    {
+        auto& path = relative_paths_to_add[i];
+
+        // In the special mode when !save_paths, process only files and not directories.
+        // Directories have trailing '\\' in their paths.
+        if(!save_paths && path.back() == L'\\')
+        {
+            relative_paths_to_add.erase(relative_paths_to_add.begin() + i);
+        }
+        else
+        {
+            StripTrailingSlash(path);
+            assert(!path.empty());
+        }
+    }
+
+    /*
+    In the mode when save_paths == false, we have to remove duplicates because
+    different subdirectories can contain files with same name that would be packed
+    to same archive directory.
+    */
+    if(!save_paths)
+        RemoveFileNameDuplicates(relative_paths_to_add);
+
+    std::sort(relative_paths_to_add.begin(), relative_paths_to_add.end(), StricmpPred());
+
+    std::vector<std::wstring> archive_paths_to_add(relative_paths_to_add.size());
+    std::transform(
+        relative_paths_to_add.begin(), relative_paths_to_add.end(),
+        archive_paths_to_add.begin(),
+        [save_paths, subPath](const std::wstring& relative_path) -> std::wstring
+        {
+            std::wstring archive_path;
+            if(save_paths)
+                archive_path = CombinePath(subPath, relative_path);
+            else
+            {
+                auto name = ExtractFileName(relative_path);
+                archive_path = CombinePath(subPath, name);
+            }
+            return archive_path;
+        });
+
+    std::vector<bool> path_is_directory(relative_paths_to_add.size());
+    std::fill(path_is_directory.begin(), path_is_directory.end(), false);
+    // Files whose entries are kept by kEnableIncrementalUpdate.
+    std::vector<bool> unchanged_files(relative_paths_to_add.size());
+
+    // Created before entries are matched, as IsFileUnchanged may read source files.
+    if(kEnablePackPipeline && !pipeline_thread_pool_)
+        pipeline_thread_pool_ = std::make_unique<ThreadPool>(kPackPipelineThreadCount);
+    // Current and next source file are read ahead, each with one more chunk being
+    // consumed, while the archive is written behind.
+    if(!io_buffer_sizer_)
+    {
+        io_buffer_sizer_ = std::make_unique<IoBufferSizer>(kBufSize,
+            CalcMaxIoBufferSize(2 * (kReadAheadChunkCount + 1) + kMaxPendingWrites + 1));
+    }
+
+    OpenForPack(packedFile);
+
+    if(created_new_archive_)
+        data_end_offset_ = kFileHeader.size();
+    else
+    {
+        ReadAndCheckHeader();
+        if(old_file_header_)
+        {
+            // New entries have extra fields, so readers of version 1.00 must reject the archive.
+            SeekOrThrow(archive_file_.get(), 0, SEEK_SET);
+            WriteOrThrow(kFileHeader.data(), 1, kFileHeader.size(), archive_file_.get());
+            old_file_header_ = false;
+        }
+        // Usually there are much fewer paths to add than entries, so they are indexed.
+        const PathSet replaced_paths(archive_paths_to_add);
+        // Entry of a file being added is replaced, unless the file didn't change.
+        auto is_replaced = [&](const std::wstring& path, const EntryHeader& header,
+            const std::vector<char>& extra_fields) -> bool
+        {
+            const std::wstring* archive_path = replaced_paths.Find(path);
+            if(!archive_path)
+                return false;
+            const size_t i = (size_t)(archive_path - archive_paths_to_add.data());
+            if(kEnableIncrementalUpdate &&
+                IsFileUnchanged(header, extra_fields, CombinePath(srcPath, relative_paths_to_add[i])))
+            {
+                unchanged_files[i] = true;
+                path_is_directory[i] = (header.attributes & FILE_ATTR_DIRECTORY) != 0;
+                return false;
+            }
+            return true;
+        };
+        if(ReadCentralDirectory())
+            MarkReplacedEntriesDeleted(is_replaced);
+        else
+        {
+            DeleteIf([this, &is_replaced]() -> bool
+                {
+                    return is_replaced(last_header_path_, last_header_, last_header_extra_fields_);
+                });
+        }
+        MarkUnusedSolidBlocksDeleted();
+
+        // Done before packing, so new entries don't need to be moved.
+        if(ShouldCompact())
+            Compact(packedFile);
+
+        // New entries overwrite the old central directory. It is removed first, so
+        // the archive stays readable by linear scan if packing fails in the middle.
+        TruncateOrThrow(archive_file_.get(), data_end_offset_);
+    }
+    SeekOrThrow(archive_file_.get(), (long long)data_end_offset_, SEEK_SET);
+
+    std::wstring absolute_path;
+
+    // Until packing is done, data_end_offset_ is the end of entries written completely.
+    // They are kept if packing fails or is cancelled.
+    try
+    {
+        if(kEnableDeduplication)
+            LoadContentEntries();
+
+        if(kEnableDictionary && kPackCodec == kCodecZlib)
+            PrepareDictionary(srcPath, relative_paths_to_add);
+        data_end_offset_ = (uint64_t)_ftelli64(archive_file_.get());
+
+        if(kEnableFreeSpaceReuse)
+            LoadFreeExtents();
+
+        {
+            // Next file is opened and read ahead while the current one is packed. If that
+            // fails, PackFile opens it again and reports the error.
+            // Unchanged files are not opened.
+            std::unique_ptr<ReadAheadFile> next_src_file;
+            if(!relative_paths_to_add.empty() && !unchanged_files[0])
+                next_src_file = OpenSrcFile(CombinePath(srcPath, relative_paths_to_add[0]));
+            for(size_t i = 0, count = relative_paths_to_add.size(); i < count; ++i)
+            {
+                const std::wstring& relative_path = relative_paths_to_add[i];
+                const std::wstring& archive_path = archive_paths_to_add[i];
+
+                absolute_path = CombinePath(srcPath, relative_path);
+                assert(!absolute_path.empty());
+
+                size_t file_count_percent = CalcPercent(i, count);
+                int progress = -(int)file_count_percent;
+                if(UpdateDirectProgress(const_cast<wchar_t*>(absolute_path.c_str()), progress))
+                    throw E_EABORTED;
+
+                std::unique_ptr<ReadAheadFile> src_file = std::move(next_src_file);
+                if(i + 1 < count && !unchanged_files[i + 1])
+                    next_src_file = OpenSrcFile(CombinePath(srcPath, relative_paths_to_add[i + 1]));
+                if(unchanged_files[i])
+                    continue;
+
+                bool is_directory = false;
+                PackFile(is_directory, absolute_path, archive_path, save_paths, std::move(src_file));
+                path_is_directory[i] = is_directory;
+                data_end_offset_ = (uint64_t)_ftelli64(archive_file_.get());
+            }
+        }
+        FlushSolidBlock();
+
+        data_end_offset_ = (uint64_t)_ftelli64(archive_file_.get());
+    }
+    catch(int)
+    {
+        CloseFailedPack();
+        throw;
+    }
+    WriteContentHashes();
+    RemoveReusedEntries();
+    WriteCentralDirectory();
+
+    if(delete_source_files)
+    {
+        // Items must be deleted in reverse order so files and subdirectories are
+        // deleted before parent directories.
+        for(size_t i = relative_paths_to_add.size(); i--; )
+        {
+            absolute_path = CombinePath(srcPath, relative_paths_to_add[i]);
+            assert(!absolute_path.empty());
+            DeleteSrcFile(absolute_path, path_is_directory[i]);
+        }
+    }
+
+    return 0;
+}
+
+template<typename Pred>
+void PackingArchive::MarkReplacedEntriesDeleted(Pred is_replaced)
+{
+    std::vector<size_t> replaced_entries;
+    for(size_t i = 0, count = index_.size(); i < count; ++i)
+    {
+        const IndexEntry& entry = index_[i];
+        // Solid block is deleted only with all its files. Dictionary is never deleted.
+        if((entry.header.flags & (kEntryFlagDeleted | kEntryFlagsInternal)) == 0 &&
+            is_replaced(entry.path, entry.header, entry.extra_fields))
+        {
+            replaced_entries.push_back(i);
+        }
+
+        int progress = -(int)CalcPercent(i, count);
+        if(UpdateDirectProgress(nullptr, progress))
+            throw E_EABORTED;
+    }
+    MarkEntriesDeleted(std::move(replaced_entries));
+}
+
+void PackingArchive::LoadContentEntries()
+{
+    content_entries_.clear();
+    for(size_t i = 0, count = index_.size(); i < count; ++i)
+    {
+        const IndexEntry& entry = index_[i];
+        if(GetContentHash(entry.header, entry.extra_fields) != 0)
+            content_entries_.emplace(uint64_t{entry.header.unp_size}, i);
+    }
+}
+
+// Reads src_file to the end. Returns number of bytes read.
+static uint64_t ReadFileChecksums(uint32_t& out_crc32, uint64_t& out_content_hash, ReadAheadFile& src_file)
+{
+    out_crc32 = 0;
+    ContentHasher content_hasher;
+    uint64_t bytes_read = 0;
+    for(std::span<const char> src_data = src_file.Peek(); !src_data.empty(); src_data = src_file.Peek())
+    {
+        out_crc32 = Crc32(out_crc32, src_data.data(), src_data.size());
+        content_hasher.Update(src_data.data(), src_data.size());
+        bytes_read += src_data.size();
+        src_file.Skip(src_data.size());
+    }
+    out_content_hash = content_hasher.Finish();
+    return bytes_read;
+}
+
+bool PackingArchive::IsFileUnchanged(const EntryHeader& header, const std::vector<char>& extra_fields,
+    const wstr_view& absolute_path)
+{
+    EntryHeader file_header = {};
+    try
+    {
+        GetFileAttributes(file_header, absolute_path);
+    }
+    catch(int)
+    {
+        return false;
+    }
+    if(file_header.unp_size != header.unp_size || file_header.time != header.time ||
+        file_header.attributes != header.attributes)
+        return false;
+    if(!kVerifyUnchangedFileContent || (header.attributes & FILE_ATTR_DIRECTORY) != 0)
+        return true;
+
+    const EntryExtra extra = ParseExtraFields(extra_fields);
+    if(!extra.has_crc32)
+        return false;
+    std::unique_ptr<ReadAheadFile> src_file = OpenSrcFile(absolute_path);
+    if(!src_file)
+        return false;
+    uint32_t crc32 = 0;
+    uint64_t content_hash = 0;
+    if(ReadFileChecksums(crc32, content_hash, *src_file) != header.unp_size || crc32 != extra.crc32)
+        return false;
+    // Duplicate refers to the hash of its content.
+    const uint64_t entry_content_hash = extra.content_hash != 0 ? extra.content_hash : extra.duplicate_of;
+    return entry_content_hash == 0 || entry_content_hash == content_hash;
+}
+
+size_t PackingArchive::FindContentEntry(uint64_t unp_size, uint32_t crc32, uint64_t content_hash) const
+{
+    auto [begin, end] = content_entries_.equal_range(unp_size);
+    auto it = std::find_if(begin, end, [this, crc32, content_hash](const auto& content_entry)
+        {
+            const EntryExtra extra = ParseExtraFields(index_[content_entry.second].extra_fields);
+            return extra.content_hash == content_hash && extra.crc32 == crc32;
+        });
+    return it != end ? it->second : SIZE_MAX;
+}
+
+void PackingArchive::PackDuplicateFile(EntryHeader& header, const std::wstring& path, uint32_t crc32,
+    uint64_t content_hash, size_t target_entry)
+{
+    content_hashes_to_write_.push_back(target_entry);
+    ReserveDeletedEntry(target_entry);
 
-    if(CallProcessDataProc(packedFile, 0) == 0)
-        throw E_EABORTED;
-    last_progress_time_ = GetTickCount64();
+    header.magic = kEntryMagic;
+    header.flags = kEntryFlagExtraFields;
+    header.pack_size = 0;
+    assert(path.length() <= USHRT_MAX);
+    header.path_len = (uint16_t)path.length();
+    std::vector<char> extra_fields;
+    AppendExtraField(extra_fields, kExtraFieldCrc32, &crc32, sizeof(crc32));
+    AppendExtraField(extra_fields, kExtraFieldDuplicateOf, &content_hash, sizeof(content_hash));
+    const uint64_t entry_offset = (uint64_t)_ftelli64(archive_file_.get());
+    WriteEntryHeader(header, path, extra_fields);
+    index_.push_back(IndexEntry{entry_offset, header, path, std::move(extra_fields)});
+    // Linear scan finds the data only in an entry read before.
+    MoveToFreeSpace(index_.size() - 1, entry_offset, index_[target_entry].offset, false);
+}
 
-    auto relative_paths_to_add = ParseStringList(addList);
+void PackingArchive::WriteContentHashes()
+{
+    if(content_hashes_to_write_.empty())
+        return;
 
-    for(size_t i = relative_paths_to_add.size(); i--; )
+    FILE* const archive_file_ptr = archive_file_.get();
+    const uint64_t cursor_offset = (uint64_t)_ftelli64(archive_file_ptr);
+    std::sort(content_hashes_to_write_.begin(), content_hashes_to_write_.end());
+    content_hashes_to_write_.erase(std::unique(content_hashes_to_write_.begin(), content_hashes_to_write_.end()),
+        content_hashes_to_write_.end());
+    for(size_t i : content_hashes_to_write_)
     {
-        auto& path = relative_paths_to_add[i];
+        const IndexEntry& entry = index_[i];
+        const size_t field_offset = FindExtraField(entry.extra_fields, kExtraFieldContentHash, sizeof(uint64_t));
+        // Header size without extra fields is their offset.
+        SeekOrThrow(archive_file_ptr, (long long)(entry.offset +
+            GetEntryHeaderSize(entry.header, 0) +
+            field_offset), SEEK_SET);
+        WriteOrThrow(entry.extra_fields.data() + field_offset, sizeof(uint64_t), 1, archive_file_ptr);
+    }
+    content_hashes_to_write_.clear();
+    SeekOrThrow(archive_file_ptr, (long long)cursor_offset, SEEK_SET);
+}
 
-        // In the special mode when !save_paths, process only files and not directories.
-        // Directories have trailing '\\' in their paths.
-        if(!save_paths && path.back() == L'\\')
+void PackingArchive::LoadFreeExtents()
+{
+    free_extents_.clear();
+    free_extent_offsets_by_size_.clear();
+    reused_entries_.clear();
+
+    const std::vector<bool> deleted_in_use = FindDeletedEntriesInUse();
+    // Going backwards, tells if a solid file that is not deleted follows before the next solid block.
+    bool followed_by_solid_file = false;
+    uint64_t extent_offset = 0;
+    FreeExtent extent = {};
+    for(size_t i = index_.size(); i--; )
+    {
+        const IndexEntry& entry = index_[i];
+        const bool is_free = (entry.header.flags & kEntryFlagDeleted) != 0 && !deleted_in_use[i];
+        // Extent doesn't span a stale central directory, which is not in index_.
+        if(!extent.entries.empty() && (!is_free || entry.offset + GetEntrySize(entry) != extent_offset))
         {
-            relative_paths_to_add.erase(relative_paths_to_add.begin() + i);
+            std::reverse(extent.entries.begin(), extent.entries.end());
+            AddFreeExtent(extent_offset, std::move(extent));
+            extent = {};
         }
-        else
+        if(is_free)
         {
-            StripTrailingSlash(path);
-            assert(!path.empty());
+            if(extent.entries.empty())
+                extent.followed_by_solid_file = followed_by_solid_file;
+            extent.entries.push_back(i);
+            extent.size += GetEntrySize(entry);
+            extent_offset = entry.offset;
         }
+        else if(entry.header.flags & kEntryFlagSolidBlock)
+            followed_by_solid_file = false;
+        else if(entry.header.flags & kEntryFlagSolid)
+            followed_by_solid_file = true;
     }
+    if(!extent.entries.empty())
+    {
+        std::reverse(extent.entries.begin(), extent.entries.end());
+        AddFreeExtent(extent_offset, std::move(extent));
+    }
+}
 
-    /*
-    In the mode when save_paths == false, we have to remove duplicates because
-    different subdirectories can contain files with same name that would be packed
-    to same archive directory.
-    */
-    if(!save_paths)
-        RemoveFileNameDuplicates(relative_paths_to_add);
-
-    std::sort(relative_paths_to_add.begin(), relative_paths_to_add.end(), StricmpPred());
+void PackingArchive::AddFreeExtent(uint64_t offset, FreeExtent&& extent)
+{
+    // Moving entries in starts with turning the extent into a single deleted entry.
+    if(extent.size < kFreeSpaceEntryMinSize)
+        return;
+    free_extent_offsets_by_size_.emplace(extent.size, offset);
+    free_extents_.emplace(offset, std::move(extent));
+}
 
-    std::vector<std::wstring> archive_paths_to_add(relative_paths_to_add.size());
-    std::transform(
-        relative_paths_to_add.begin(), relative_paths_to_add.end(),
-        archive_paths_to_add.begin(),
-        [save_paths, subPath](const std::wstring& relative_path) -> std::wstring
+void PackingArchive::RemoveFreeExtent(std::map<uint64_t, FreeExtent>::iterator it)
+{
+    auto [begin, end] = free_extent_offsets_by_size_.equal_range(it->second.size);
+    for(auto size_it = begin; size_it != end; ++size_it)
+    {
+        if(size_it->second == it->first)
         {
-            std::wstring archive_path;
-            if(save_paths)
-                archive_path = CombinePath(subPath, relative_path);
-            else
-            {
-                auto name = ExtractFileName(relative_path);
-                archive_path = CombinePath(subPath, name);
-            }
-            return archive_path;
-        });
+            free_extent_offsets_by_size_.erase(size_it);
+            break;
+        }
+    }
+    free_extents_.erase(it);
+}
 
-    std::vector<bool> path_is_directory(relative_paths_to_add.size());
-    std::fill(path_is_directory.begin(), path_is_directory.end(), false);
+void PackingArchive::ReserveDeletedEntry(size_t entry_index)
+{
+    const IndexEntry& entry = index_[entry_index];
+    auto it = free_extents_.upper_bound(entry.offset);
+    if(it == free_extents_.begin())
+        return;
+    --it;
+    std::vector<size_t>& entries = it->second.entries;
+    auto entry_it = std::find(entries.begin(), entries.end(), entry_index);
+    if(entry_it == entries.end())
+        return;
 
-    OpenForPack(packedFile);
+    // The extent is split into the deleted entries before and after this one.
+    const uint64_t before_offset = it->first;
+    const uint64_t after_offset = entry.offset + GetEntrySize(entry);
+    FreeExtent before = {entry.offset - before_offset, std::vector<size_t>(entries.begin(), entry_it),
+        it->second.followed_by_solid_file};
+    FreeExtent after = {before_offset + it->second.size - after_offset, std::vector<size_t>(entry_it + 1, entries.end()),
+        it->second.followed_by_solid_file};
+    RemoveFreeExtent(it);
+    AddFreeExtent(before_offset, std::move(before));
+    AddFreeExtent(after_offset, std::move(after));
+}
+
+void PackingArchive::MoveToFreeSpace(size_t first_entry, uint64_t begin_offset, uint64_t min_offset, bool is_solid_block)
+{
+    if(free_extents_.empty())
+        return;
 
-    if(!created_new_archive_)
+    FILE* const archive_file_ptr = archive_file_.get();
+    const uint64_t end_offset = (uint64_t)_ftelli64(archive_file_ptr);
+    const uint64_t size = end_offset - begin_offset;
+
+    // Best fit: the smallest extent that the entries fill exactly or leave room for
+    // a deleted entry in.
+    auto size_it = free_extent_offsets_by_size_.lower_bound(size);
+    for(; size_it != free_extent_offsets_by_size_.end(); ++size_it)
     {
-        ReadAndCheckHeader();
+        if(size_it->first != size && size_it->first - size < kFreeSpaceEntryMinSize)
+            continue;
+        if(size_it->second <= min_offset)
+            continue;
+        if(is_solid_block && free_extents_.at(size_it->second).followed_by_solid_file)
+            continue;
+        break;
+    }
+    if(size_it == free_extent_offsets_by_size_.end())
+        return;
 
-        DeleteIf([this, &archive_paths_to_add]() -> bool
+    const uint64_t offset = size_it->second;
+    auto extent_it = free_extents_.find(offset);
+    const FreeExtent extent = std::move(extent_it->second);
+    free_extent_offsets_by_size_.erase(size_it);
+    free_extents_.erase(extent_it);
+
+    // Overwritten entries can no longer be referred to by duplicates.
+    for(size_t i : extent.entries)
+    {
+        auto [begin, end] = content_entries_.equal_range(uint64_t{index_[i].header.unp_size});
+        for(auto it = begin; it != end; ++it)
+        {
+            if(it->second == i)
             {
-                auto it = std::lower_bound(archive_paths_to_add.begin(), archive_paths_to_add.end(), last_header_path_, StricmpPred());
-                return it != archive_paths_to_add.end() &&
-                    _wcsicmp(last_header_path_.c_str(), it->c_str()) == 0;
-            });
+                content_entries_.erase(it);
+                break;
+            }
+        }
+        reused_entries_.push_back(i);
     }
 
-    std::wstring absolute_path;
-    for(size_t i = 0, count = relative_paths_to_add.size(); i < count; ++i)
+    // The extent is a single deleted entry until header of the first moved entry is
+    // written last, so the archive stays readable by linear scan if it fails in the middle.
+    WriteFreeSpaceEntry(archive_file_ptr, offset, extent.size);
+    std::vector<char> buf = buffer_pool_.Acquire((size_t)std::min<uint64_t>(size, kCompactionBufSize));
+    for(uint64_t copied = sizeof(EntryHeader); copied < size; )
     {
-        const std::wstring& relative_path = relative_paths_to_add[i];
-        const std::wstring& archive_path = archive_paths_to_add[i];
-
-        absolute_path = CombinePath(srcPath, relative_path);
-        assert(!absolute_path.empty());
+        const size_t chunk_size = (size_t)std::min<uint64_t>(buf.size(), size - copied);
+        SeekOrThrow(archive_file_ptr, (long long)(begin_offset + copied), SEEK_SET);
+        ReadOrThrow(buf.data(), 1, chunk_size, archive_file_ptr);
+        SeekOrThrow(archive_file_ptr, (long long)(offset + copied), SEEK_SET);
+        WriteOrThrow(buf.data(), 1, chunk_size, archive_file_ptr);
+        copied += chunk_size;
+    }
+    const size_t end_entry = index_.size();
+    if(extent.size > size)
+    {
+        index_.push_back(WriteFreeSpaceEntry(archive_file_ptr, offset + size, extent.size - size));
+        AddFreeExtent(offset + size, FreeExtent{extent.size - size, {index_.size() - 1}, extent.followed_by_solid_file});
+    }
+    SeekOrThrow(archive_file_ptr, (long long)begin_offset, SEEK_SET);
+    ReadOrThrow(buf.data(), 1, sizeof(EntryHeader), archive_file_ptr);
+    SeekOrThrow(archive_file_ptr, (long long)offset, SEEK_SET);
+    WriteOrThrow(buf.data(), 1, sizeof(EntryHeader), archive_file_ptr);
+    buffer_pool_.Release(std::move(buf));
+
+    for(size_t i = first_entry; i < end_entry; ++i)
+        index_[i].offset = index_[i].offset - begin_offset + offset;
+
+    // Copy at the end is cut off, so new entries continue where it began.
+    TruncateOrThrow(archive_file_ptr, begin_offset);
+    SeekOrThrow(archive_file_ptr, (long long)begin_offset, SEEK_SET);
+}
 
-        size_t file_count_percent = CalcPercent(i, count);
-        int progress = -(int)file_count_percent;
-        if(UpdateDirectProgress(const_cast<wchar_t*>(absolute_path.c_str()), progress))
-            throw E_EABORTED;
+void PackingArchive::RemoveReusedEntries()
+{
+    if(reused_entries_.empty())
+        return;
 
-        bool is_directory = false;
-        PackFile(is_directory, absolute_path, archive_path, save_paths);
-        path_is_directory[i] = is_directory;
+    std::vector<bool> reused(index_.size());
+    for(size_t i : reused_entries_)
+        reused[i] = true;
+    size_t dst = 0;
+    for(size_t src = 0, count = index_.size(); src < count; ++src)
+    {
+        if(!reused[src])
+            index_[dst++] = std::move(index_[src]);
     }
+    index_.resize(dst);
+    // Moved entries are out of file order.
+    std::sort(index_.begin(), index_.end(), [](const IndexEntry& a, const IndexEntry& b)
+        {
+            return a.offset < b.offset;
+        });
 
-    if(delete_source_files)
+    reused_entries_.clear();
+    free_extents_.clear();
+    free_extent_offsets_by_size_.clear();
+}
+
+void PackingArchive::CloseFailedPack()
+{
+    try
     {
-        // Items must be deleted in reverse order so files and subdirectories are
-        // deleted before parent directories.
-        for(size_t i = relative_paths_to_add.size(); i--; )
-        {
-            absolute_path = CombinePath(srcPath, relative_paths_to_add[i]);
-            assert(!absolute_path.empty());
-            DeleteSrcFile(absolute_path, path_is_directory[i]);
-        }
+        // Duplicates already written may refer to these hashes.
+        WriteContentHashes();
+        RemoveReusedEntries();
+        // Entry being written, and entries not moved into free space yet, are cut off.
+        index_.erase(std::remove_if(index_.begin(), index_.end(), [this](const IndexEntry& entry)
+            {
+                return entry.offset >= data_end_offset_;
+            }), index_.end());
+        TruncateOrThrow(archive_file_.get(), data_end_offset_);
+        WriteCentralDirectory();
+    }
+    catch(int)
+    {
+        // Error of packing is reported instead. The archive is still readable by linear scan.
     }
-
-    return 0;
 }
 
 void PackingArchive::OpenForPack(const wstr_view& archive_path)
@@ -778,8 +2598,20 @@ void PackingArchive::OpenForPack(const wstr_view& archive_path)
     throw E_ECREATE;
 }
 
+std::unique_ptr<ReadAheadFile> PackingArchive::OpenSrcFile(const wstr_view& absolute_path)
+{
+    FILE* src_file_ptr = nullptr;
+    errno_t e = _wfopen_s(&src_file_ptr, absolute_path.c_str(), L"rb");
+    if (e != 0)
+        return nullptr;
+    UniqueFilePtr src_file(src_file_ptr);
+    const uint64_t file_size = GetFileSize(src_file_ptr);
+    return std::make_unique<ReadAheadFile>(std::move(src_file), file_size, pipeline_thread_pool_.get(),
+        buffer_pool_, *io_buffer_sizer_, kReadAheadChunkCount);
+}
+
 void PackingArchive::PackFile(bool& out_is_directory, const wstr_view& absolute_path,
-    const wstr_view& archive_path, bool save_paths)
+    const wstr_view& archive_path, bool save_paths, std::unique_ptr<ReadAheadFile> src_file)
 {
     out_is_directory = false;
 
@@ -792,12 +2624,40 @@ void PackingArchive::PackFile(bool& out_is_directory, const wstr_view& absolute_
 
     entry_header.pack_size = entry_header.unp_size;
 
-    const bool enable_compression_for_file = EnableCompressionForFile(entry_header.unp_size);
+    out_is_directory = (entry_header.attributes & FILE_ATTR_DIRECTORY) != 0;
+
+    if (out_is_directory)
+        src_file.reset();
+    else if (!src_file)
+    {
+        src_file = OpenSrcFile(absolute_path);
+        if (!src_file)
+            throw E_EOPEN;
+    }
+
+    // Compressibility of small files is not checked, as it would cost as much as compressing them.
+    if (!out_is_directory && kEnableSolidCompression &&
+        EnableCompressionForFile(entry_header.unp_size) && entry_header.unp_size <= kMaxSolidFileSize)
+    {
+        entry_header.magic = kEntryMagic;
+        assert(path.length() <= USHRT_MAX);
+        entry_header.path_len = (uint16_t)path.length();
+        AddSolidFile(entry_header, std::move(path), *src_file);
+        return;
+    }
+
+    const bool enable_deduplication = !out_is_directory && kEnableDeduplication &&
+        entry_header.unp_size >= kMinFileSizeForDeduplication;
+
+    bool enable_compression_for_file = EnableCompressionForFile(entry_header.unp_size);
+    // Checked before writing the header, so incompressible file is just stored.
+    if (enable_compression_for_file && kEnableCompressibilityCheck)
+        enable_compression_for_file = IsSampleCompressible(*src_file, codec_pool_);
 
     if (enable_compression_for_file)
         entry_header.flags |= kEntryFlagCompressed;
-
-    out_is_directory = (entry_header.attributes & FILE_ATTR_DIRECTORY) != 0;
+    const bool use_dictionary = enable_compression_for_file && kPackCodec == kCodecZlib && !dictionary_.empty() &&
+        !UseParallelCompression(entry_header.unp_size, enable_compression_for_file, kPackCodec);
 
     uint64_t entry_begin_offset = (uint64_t)_ftelli64(archive_file_.get());
     
@@ -805,50 +2665,282 @@ void PackingArchive::PackFile(bool& out_is_directory, const wstr_view& absolute_
     
     assert(path.length() <= USHRT_MAX);
     entry_header.path_len = (uint16_t)path.length();
+
+    std::vector<char> extra_fields;
+    if (!out_is_directory)
+    {
+        // CRC-32 is known only after packing. It is the first extra field, so it can be
+        // updated at known offset.
+        const uint32_t crc32_placeholder = 0;
+        AppendExtraField(extra_fields, kExtraFieldCrc32, &crc32_placeholder, sizeof(crc32_placeholder));
+        // Missing codec means zlib, as in archives written before codecs were introduced.
+        if (enable_compression_for_file && kPackCodec != kCodecZlib)
+        {
+            const uint8_t codec = kPackCodec;
+            AppendExtraField(extra_fields, kExtraFieldCodec, &codec, sizeof(codec));
+        }
+        if (use_dictionary)
+            AppendExtraField(extra_fields, kExtraFieldDictionaryId, &dictionary_id_, sizeof(dictionary_id_));
+        entry_header.flags |= kEntryFlagExtraFields;
+    }
+    // Content hash is known only after packing too.
+    size_t content_hash_offset_in_extra_fields = 0;
+    if (enable_deduplication)
+    {
+        const uint64_t content_hash_placeholder = 0;
+        AppendExtraField(extra_fields, kExtraFieldContentHash, &content_hash_placeholder, sizeof(content_hash_placeholder));
+        content_hash_offset_in_extra_fields = extra_fields.size() - sizeof(content_hash_placeholder);
+    }
+
+    // Offsets of seek points are known only after packing, like CRC-32. Their number
+    // is known now, so the table has its final size.
+    const uint64_t seek_interval = enable_compression_for_file ? GetSeekPointInterval(entry_header.unp_size) : 0;
+    size_t seek_offsets_offset_in_extra_fields = 0;
+    if (seek_interval != 0)
+    {
+        std::vector<uint64_t> seek_table(1 + GetSeekPointCount(entry_header.unp_size, seek_interval));
+        seek_table[0] = seek_interval;
+        AppendExtraField(extra_fields, kExtraFieldSeekTable, seek_table.data(),
+            (uint16_t)(seek_table.size() * sizeof(uint64_t)));
+        seek_offsets_offset_in_extra_fields = extra_fields.size() - (seek_table.size() - 1) * sizeof(uint64_t);
+    }
     
-    WriteEntryHeader(entry_header, path);
+    WriteEntryHeader(entry_header, path, extra_fields);
 
     // Write file contents.
     if (!out_is_directory)
     {
         bool cancelled = false;
 
-        FILE* src_file_ptr = nullptr;
-        errno_t e = _wfopen_s(&src_file_ptr, absolute_path.c_str(), L"rb");
-        if (e != 0)
-            throw E_EOPEN;
-        UniqueFilePtr src_file(src_file_ptr);
-
         FILE* archive_file_ptr = archive_file_.get();
 
         uint64_t bytes_written = 0;
         uint64_t bytes_read = 0;
+        uint32_t crc32 = 0;
+        uint64_t content_hash = 0;
+        std::vector<uint64_t> seek_offsets;
         PackFileContent(
-            bytes_written, bytes_read,
-            archive_file_ptr, src_file_ptr, entry_header.unp_size, enable_compression_for_file);
+            bytes_written, bytes_read, crc32, content_hash, seek_offsets,
+            archive_file_ptr, *src_file, entry_header.unp_size, enable_compression_for_file, kPackCodec,
+            use_dictionary ? std::span<const char>(dictionary_) : std::span<const char>(), seek_interval);
+        assert(seek_offsets.size() == GetSeekPointCount(entry_header.unp_size, seek_interval));
+        const size_t seek_offsets_size = seek_offsets.size() * sizeof(uint64_t);
 
         if (cancelled)
             throw E_EABORTED;
 
-        if (enable_compression_for_file)
+        // Duplicate is found by the hash computed while packing, so the file is read once.
+        // Its data is still at the end of the archive and is dropped for an entry referring
+        // to the earlier one.
+        const size_t target_entry = enable_deduplication ?
+            FindContentEntry(entry_header.unp_size, crc32, content_hash) : SIZE_MAX;
+        if (target_entry != SIZE_MAX)
         {
-            if (bytes_written != bytes_read)
-            {
-                // Update pack_size in entry header.
-                uint64_t entry_end_offset = (uint64_t)_ftelli64(archive_file_ptr);
-                SeekOrThrow(archive_file_ptr, entry_begin_offset +
-                    sizeof(kEntryMagic) +
-                    sizeof(uint8_t) + // flags
-                    sizeof(uint8_t) + // attributes
-                    sizeof(uint32_t), // time
-                    SEEK_SET);
-                WriteOrThrow(&bytes_written, sizeof(bytes_written), 1, archive_file_ptr);
-                SeekOrThrow(archive_file_ptr, entry_end_offset, SEEK_SET);
-            }
+            SeekOrThrow(archive_file_ptr, (long long)entry_begin_offset, SEEK_SET);
+            TruncateOrThrow(archive_file_ptr, entry_begin_offset);
+            PackDuplicateFile(entry_header, path, crc32, content_hash, target_entry);
+            return;
         }
+
+        const size_t crc32_offset_in_extra_fields = 2 * sizeof(uint16_t); // tag, size
+        if (enable_compression_for_file)
+            entry_header.pack_size = bytes_written;
         else
             assert(bytes_written == bytes_read);
+        memcpy(extra_fields.data() + crc32_offset_in_extra_fields, &crc32, sizeof(crc32));
+        if (enable_deduplication)
+            memcpy(extra_fields.data() + content_hash_offset_in_extra_fields, &content_hash, sizeof(content_hash));
+        if (!seek_offsets.empty())
+            memcpy(extra_fields.data() + seek_offsets_offset_in_extra_fields, seek_offsets.data(), seek_offsets_size);
+
+        // Whole header is written again with pack_size, CRC-32, content hash and seek table,
+        // with a seek back and a seek forward, so a linear scan can skip the data.
+        const uint64_t entry_end_offset = (uint64_t)_ftelli64(archive_file_ptr);
+        SeekOrThrow(archive_file_ptr, (long long)entry_begin_offset, SEEK_SET);
+        WriteEntryHeader(entry_header, path, extra_fields);
+        SeekOrThrow(archive_file_ptr, (long long)entry_end_offset, SEEK_SET);
+    }
+
+    // Later files with the same content become its duplicates.
+    const size_t entry_index = index_.size();
+    if (enable_deduplication)
+        content_entries_.emplace(uint64_t{entry_header.unp_size}, entry_index);
+    index_.push_back(IndexEntry{entry_begin_offset, entry_header, std::move(path), std::move(extra_fields)});
+    MoveToFreeSpace(entry_index, entry_begin_offset, use_dictionary ? dictionary_offset_ : 0, false);
+}
+
+void PackingArchive::PrepareDictionary(const wstr_view& src_path, std::span<const std::wstring> relative_paths)
+{
+    FILE* const archive_file_ptr = archive_file_.get();
+
+    // Dictionary already in the archive is used for all new entries, so there is one per archive.
+    uint32_t max_id = 0;
+    for (const IndexEntry& entry : index_)
+    {
+        if ((entry.header.flags & kEntryFlagDictionary) == 0)
+            continue;
+        const uint32_t id = ParseExtraFields(entry.extra_fields).dictionary_id;
+        max_id = std::max(max_id, id);
+        if ((entry.header.flags & (kEntryFlagDeleted | kEntryFlagCompressed)) != 0)
+            continue;
+        if (id == 0 || entry.header.pack_size != entry.header.unp_size || entry.header.unp_size > kMaxDictionarySize)
+            throw E_BAD_ARCHIVE;
+
+        const uint64_t cursor_offset = (uint64_t)_ftelli64(archive_file_ptr);
+        dictionary_.resize((size_t)entry.header.unp_size);
+        SeekOrThrow(archive_file_ptr, (long long)(entry.offset +
+            GetEntryHeaderSize(entry.header, entry.extra_fields.size())), SEEK_SET);
+        ReadOrThrow(dictionary_.data(), 1, dictionary_.size(), archive_file_ptr);
+        SeekOrThrow(archive_file_ptr, (long long)cursor_offset, SEEK_SET);
+        dictionary_id_ = id;
+        dictionary_offset_ = entry.offset;
+        return;
+    }
+
+    // Otherwise it is trained from beginnings of small files, spread over the list.
+    const size_t stride = std::max<size_t>(1, relative_paths.size() / kMaxDictionarySamples);
+    std::vector<std::vector<char>> samples;
+    std::wstring absolute_path;
+    for (size_t i = 0; i < relative_paths.size() && samples.size() < kMaxDictionarySamples; i += stride)
+    {
+        absolute_path = CombinePath(src_path, relative_paths[i]);
+        EntryHeader header = {};
+        // Files that can't be read are skipped here. PackFile reports the error.
+        try
+        {
+            GetFileAttributes(header, absolute_path);
+        }
+        catch (int)
+        {
+            continue;
+        }
+        // Large files are compressed well without a dictionary.
+        if ((header.attributes & FILE_ATTR_DIRECTORY) != 0 ||
+            !EnableCompressionForFile(header.unp_size) || header.unp_size > kMaxSolidFileSize)
+            continue;
+
+        FILE* src_file_ptr = nullptr;
+        if (_wfopen_s(&src_file_ptr, absolute_path.c_str(), L"rb") != 0)
+            continue;
+        UniqueFilePtr src_file(src_file_ptr);
+        const uint64_t file_size = header.unp_size;
+        std::vector<char> sample((size_t)std::min<uint64_t>(file_size, kDictionarySampleSize));
+        sample.resize(fread(sample.data(), 1, sample.size(), src_file_ptr));
+        samples.push_back(std::move(sample));
+
+        if (UpdateDirectProgress(nullptr, 0))
+            throw E_EABORTED;
+    }
+    if (samples.size() < kMinDictionarySamples)
+        return;
+
+    size_t sample_bytes = 0;
+    for (const std::vector<char>& sample : samples)
+        sample_bytes += sample.size();
+    dictionary_ = TrainDictionary(samples, std::min(kMaxDictionarySize, sample_bytes / kSampleBytesPerDictionaryByte));
+    if (dictionary_.size() < kMinDictionarySize)
+    {
+        dictionary_.clear();
+        return;
+    }
+    dictionary_id_ = max_id + 1;
+
+    EntryHeader header = {};
+    header.magic = kEntryMagic;
+    header.flags = kEntryFlagDictionary | kEntryFlagExtraFields;
+    header.pack_size = dictionary_.size();
+    header.unp_size = dictionary_.size();
+    header.path_len = (uint16_t)kDictionaryPath.length();
+    std::vector<char> extra_fields;
+    AppendExtraField(extra_fields, kExtraFieldDictionaryId, &dictionary_id_, sizeof(dictionary_id_));
+    std::wstring path{kDictionaryPath};
+    const uint64_t entry_offset = (uint64_t)_ftelli64(archive_file_ptr);
+    WriteEntryHeader(header, path, extra_fields);
+    WriteOrThrow(dictionary_.data(), 1, dictionary_.size(), archive_file_ptr);
+    index_.push_back(IndexEntry{entry_offset, header, std::move(path), std::move(extra_fields)});
+    dictionary_offset_ = entry_offset;
+}
+
+void PackingArchive::AddSolidFile(const EntryHeader& header, std::wstring&& path, ReadAheadFile& src_file)
+{
+    PendingSolidFile file = { header, std::move(path) };
+    file.header.flags = kEntryFlagSolid | kEntryFlagExtraFields;
+    file.header.pack_size = 0;
+    file.offset = (uint32_t)solid_block_data_.size();
+
+    const size_t size = (size_t)header.unp_size;
+    solid_block_data_.resize(file.offset + size);
+    char* const data = solid_block_data_.data() + file.offset;
+    if (src_file.Read(data, size) != size)
+        throw E_EREAD;
+    file.crc32 = Crc32(0, data, size);
+    solid_files_.push_back(std::move(file));
+
+    if (solid_block_data_.size() >= kSolidBlockSize)
+        FlushSolidBlock();
+}
+
+void PackingArchive::FlushSolidBlock()
+{
+    if (solid_files_.empty())
+        return;
+
+    FILE* const archive_file_ptr = archive_file_.get();
+
+    const bool use_dictionary = kPackCodec == kCodecZlib && !dictionary_.empty();
+    std::vector<char> packed_data;
+    codec_pool_.AcquireCompressor(kPackCodec, use_dictionary ? std::span<const char>(dictionary_) : std::span<const char>())->
+        Compress(packed_data, solid_block_data_.data(), solid_block_data_.size(), true);
+
+    EntryHeader block_header = {};
+    block_header.magic = kEntryMagic;
+    block_header.flags = kEntryFlagSolidBlock;
+    block_header.unp_size = solid_block_data_.size();
+    block_header.path_len = (uint16_t)kSolidBlockPath.length();
+    std::vector<char> block_extra_fields;
+    const char* block_data = solid_block_data_.data();
+    if (packed_data.size() < solid_block_data_.size())
+    {
+        block_header.flags |= kEntryFlagCompressed;
+        block_data = packed_data.data();
+        if (kPackCodec != kCodecZlib)
+        {
+            const uint8_t codec = kPackCodec;
+            AppendExtraField(block_extra_fields, kExtraFieldCodec, &codec, sizeof(codec));
+            block_header.flags |= kEntryFlagExtraFields;
+        }
+        if (use_dictionary)
+        {
+            AppendExtraField(block_extra_fields, kExtraFieldDictionaryId, &dictionary_id_, sizeof(dictionary_id_));
+            block_header.flags |= kEntryFlagExtraFields;
+        }
+    }
+    block_header.pack_size = (block_header.flags & kEntryFlagCompressed) ?
+        packed_data.size() : solid_block_data_.size();
+
+    std::wstring block_path{kSolidBlockPath};
+    const uint64_t block_offset = (uint64_t)_ftelli64(archive_file_ptr);
+    const size_t block_index = index_.size();
+    WriteEntryHeader(block_header, block_path, block_extra_fields);
+    WriteOrThrow(block_data, 1, (size_t)block_header.pack_size, archive_file_ptr);
+    index_.push_back(IndexEntry{block_offset, block_header, std::move(block_path), std::move(block_extra_fields)});
+
+    // Files follow their block.
+    for (PendingSolidFile& file : solid_files_)
+    {
+        std::vector<char> extra_fields;
+        AppendExtraField(extra_fields, kExtraFieldCrc32, &file.crc32, sizeof(file.crc32));
+        AppendExtraField(extra_fields, kExtraFieldSolidOffset, &file.offset, sizeof(file.offset));
+        const uint64_t entry_offset = (uint64_t)_ftelli64(archive_file_ptr);
+        WriteEntryHeader(file.header, file.path, extra_fields);
+        index_.push_back(IndexEntry{entry_offset, file.header, std::move(file.path), std::move(extra_fields)});
     }
+    // Moved together, so the files still follow their block.
+    const bool block_uses_dictionary = (block_header.flags & kEntryFlagCompressed) && use_dictionary;
+    MoveToFreeSpace(block_index, block_offset, block_uses_dictionary ? dictionary_offset_ : 0, true);
+
+    solid_files_.clear();
+    solid_block_data_.clear();
 }
 
 void PackingArchive::DeleteSrcFile(const wstr_view& path, bool is_directory)
@@ -868,7 +2960,6 @@ int DeletingArchive::DeleteFilesW(wchar_t* packedFile, wchar_t* deleteList)
         throw E_EABORTED;
     last_progress_time_ = GetTickCount64();
 
-    // They will be upper-case and sorted.
     auto paths_to_delete = ParseStringList(deleteList);
     
     for (auto& path : paths_to_delete)
@@ -877,21 +2968,28 @@ int DeletingArchive::DeleteFilesW(wchar_t* packedFile, wchar_t* deleteList)
             path.erase(path.length() - 3);
         StripTrailingSlash(path);
         assert(!path.empty());
-        UpperCase(path);
     }
 
-    std::sort(paths_to_delete.begin(), paths_to_delete.end());
-
     if (paths_to_delete.empty())
         return 0;
 
+    // Entry is deleted with all its parent directories in the list.
+    const PathSet paths_to_delete_set(paths_to_delete);
+
     OpenForDelete(packedFile);
     ReadAndCheckHeader();
+    ReadCentralDirectory();
 
-    DeleteIf([this, &paths_to_delete]() -> bool
+    DeleteIf([this, &paths_to_delete_set]() -> bool
         {
-            return ShouldDelete(last_header_path_, paths_to_delete);
+            return paths_to_delete_set.ContainsPathOrParent(last_header_path_);
         });
+    MarkUnusedSolidBlocksDeleted();
+
+    if (ShouldCompact())
+        Compact(packedFile);
+
+    WriteCentralDirectory();
 
     return 0;
 }
@@ -912,6 +3010,36 @@ void ArchiveBase::DeleteIf(Pred pred)
     FILE* archive_file_ptr = archive_file_.get();
     assert(archive_file_ptr);
 
+    // Positions in index_ of entries to mark deleted, all at once at the end.
+    std::vector<size_t> matching_entries;
+
+    if (has_central_directory_)
+    {
+        // Entry headers don't need to be read - only flags of matching entries are written.
+        for (size_t i = 0, count = index_.size(); i < count; ++i)
+        {
+            const IndexEntry& entry = index_[i];
+            // Solid block is deleted only with all its files, by MarkUnusedSolidBlocksDeleted.
+            // Dictionary is never deleted.
+            if ((entry.header.flags & (kEntryFlagDeleted | kEntryFlagsInternal)) == 0)
+            {
+                last_header_ = entry.header;
+                last_header_path_ = entry.path;
+                if (pred())
+                    matching_entries.push_back(i);
+            }
+
+            int progress = -(int)CalcPercent(i, count);
+            if (UpdateDirectProgress(nullptr, progress))
+                throw E_EABORTED;
+        }
+        MarkEntriesDeleted(std::move(matching_entries));
+        return;
+    }
+
+    index_.clear();
+    data_end_offset_ = (uint64_t)_ftelli64(archive_file_ptr);
+
     for (;;)
     {
         long long entry_begin_offset = 0;
@@ -919,36 +3047,39 @@ void ArchiveBase::DeleteIf(Pred pred)
         {
             entry_begin_offset = _ftelli64(archive_file_ptr);
             if (!ReadEntryHeader())
+            {
+                MarkEntriesDeleted(std::move(matching_entries));
                 return;
-            if (last_header_.flags & kEntryFlagDeleted)
+            }
+            if (last_header_.flags & kEntryFlagCentralDirectory)
+            {
+                // Stale central directory, e.g. followed by entries appended by an older
+                // version. It is not an entry, so it doesn't go to index_.
+                if (GetEntryDataSize(last_header_) != 0)
+                    SeekOrThrow(archive_file_.get(), (long long)GetEntryDataSize(last_header_), SEEK_CUR);
+                continue;
+            }
+            index_.push_back(IndexEntry{(uint64_t)entry_begin_offset, last_header_, last_header_path_, last_header_extra_fields_});
+            data_end_offset_ = (uint64_t)_ftelli64(archive_file_ptr) + GetEntryDataSize(last_header_);
+            if (last_header_.flags & (kEntryFlagDeleted | kEntryFlagsInternal))
             {
-                // Skip contents and read header again.
-                if (last_header_.pack_size != 0)
-                    SeekOrThrow(archive_file_.get(), (long long)last_header_.pack_size, SEEK_CUR);
+                // Skip contents and read header again. Solid block is not passed to
+                // pred, it is deleted only with all its files. Dictionary is never deleted.
+                if (GetEntryDataSize(last_header_) != 0)
+                    SeekOrThrow(archive_file_.get(), (long long)GetEntryDataSize(last_header_), SEEK_CUR);
             }
             else
                 // Header of non-deleted entry read successfully.
                 break;
         }
         if (pred())
-        {
-            long long content_begin_offset = _ftelli64(archive_file_ptr);
-            // Set offset to Flags.
-            SeekOrThrow(archive_file_ptr, entry_begin_offset +
-                sizeof(uint32_t), // For Magic.
-                SEEK_SET);
-            // Write new flags.
-            uint8_t new_flags = last_header_.flags | kEntryFlagDeleted;
-            WriteOrThrow(&new_flags, sizeof(new_flags), 1, archive_file_ptr);
-            // Go back to content begin.
-            SeekOrThrow(archive_file_ptr, content_begin_offset, SEEK_SET);
-        }
+            matching_entries.push_back(index_.size() - 1);
         // Skip file content.
-        if (last_header_.pack_size > 0)
-            SeekOrThrow(archive_file_ptr, (long long)last_header_.pack_size, SEEK_CUR);
+        if (GetEntryDataSize(last_header_) > 0)
+            SeekOrThrow(archive_file_ptr, (long long)GetEntryDataSize(last_header_), SEEK_CUR);
 
         uint64_t progress_percent = CalcPercent((uint64_t)entry_begin_offset, original_archive_size_);
-        progress_percent = std::min(100ull, progress_percent);
+        progress_percent = std::min<uint64_t>(100, progress_percent);
         int progress = -(int)progress_percent;
         if (UpdateDirectProgress(nullptr, progress))
             throw E_EABORTED;
@@ -967,3 +3098,89 @@ BOOL HeaderCheckingArchive::CanYouHandleThisFileW(const wchar_t* filePath)
 
     return TRUE;
 }
+
+MemPacker::MemPacker(int options, const wstr_view& file_name) :
+    want_headers_((options & MEM_OPTIONS_WANTHEADERS) != 0),
+    compressor_(codec_pool_.AcquireCompressor(kPackCodec))
+{
+    if(!want_headers_)
+        return;
+
+    std::wstring path = file_name.to_string();
+    const size_t last_slash = path.find_last_of(L"\\/");
+    if(last_slash != std::wstring::npos)
+        path.erase(0, last_slash + 1);
+    if(path.empty())
+        throw E_BAD_DATA;
+    if(path.length() > kMaxFileNameLen - 1)
+        throw E_SMALL_BUF;
+
+    // Sizes and CRC-32 are known only at the end, so they go to the data descriptor.
+    EntryHeader& header = entry_.header;
+    header.magic = kEntryMagic;
+    header.flags = kEntryFlagCompressed | kEntryFlagExtraFields | kEntryFlagDataDescriptor;
+    header.attributes = FILE_ATTR_ARCHIVE;
+    FILETIME current_time;
+    GetSystemTimeAsFileTime(&current_time);
+    header.time = FileTimeToWcxTime(current_time);
+    header.path_len = (uint16_t)path.length();
+    const uint32_t crc32_placeholder = 0;
+    AppendExtraField(entry_.extra_fields, kExtraFieldCrc32, &crc32_placeholder, sizeof(crc32_placeholder));
+    if(kPackCodec != kCodecZlib)
+    {
+        const uint8_t codec = kPackCodec;
+        AppendExtraField(entry_.extra_fields, kExtraFieldCodec, &codec, sizeof(codec));
+    }
+    entry_.path = std::move(path);
+    entry_.offset = kFileHeader.size();
+
+    pending_.assign(kFileHeader.begin(), kFileHeader.end());
+    AppendEntryHeader(pending_, header, entry_.path, entry_.extra_fields);
+}
+
+int MemPacker::PackToMem(const char* src, size_t src_size, size_t& out_taken,
+    char* dst, size_t dst_capacity, size_t& out_written)
+{
+    out_taken = 0;
+    // New input is taken only when previous output is returned, so it doesn't pile up.
+    if(pending_offset_ == pending_.size())
+    {
+        pending_.clear();
+        pending_offset_ = 0;
+        if(src_size > 0)
+        {
+            entry_.header.unp_size += src_size;
+            crc32_ = Crc32(crc32_, src, src_size);
+            Compress(src, src_size, false);
+            out_taken = src_size;
+        }
+        else if(!finished_)
+        {
+            Compress(nullptr, 0, true);
+            if(want_headers_)
+            {
+                const DataDescriptor descriptor = { kDataDescriptorMagic, crc32_,
+                    entry_.header.pack_size, entry_.header.unp_size };
+                const char* descriptor_ptr = (const char*)&descriptor;
+                pending_.insert(pending_.end(), descriptor_ptr, descriptor_ptr + sizeof(descriptor));
+                SetExtraFieldCrc32(entry_.extra_fields, crc32_);
+                if(kEnableCentralDirectory)
+                    AppendCentralDirectory(pending_, std::span<const IndexEntry>(&entry_, 1),
+                        entry_.offset + GetEntrySize(entry_));
+            }
+            finished_ = true;
+        }
+    }
+
+    out_written = std::min(dst_capacity, pending_.size() - pending_offset_);
+    memcpy(dst, pending_.data() + pending_offset_, out_written);
+    pending_offset_ += out_written;
+    return finished_ && pending_offset_ == pending_.size() ? MEMPACK_DONE : MEMPACK_OK;
+}
+
+void MemPacker::Compress(const char* src, size_t src_size, bool is_last)
+{
+    const size_t pending_size = pending_.size();
+    compressor_->Compress(pending_, src, src_size, is_last);
+    entry_.header.pack_size += pending_.size() - pending_size;
+}
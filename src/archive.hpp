@@ -24,11 +24,77 @@ SOFTWARE.
 #pragma once
 
 #include "utils.hpp"
+#include "codec.hpp"
+#include "checksum.hpp"
 
 enum EntryFlag
 {
     kEntryFlagDeleted    = 0x01,
     kEntryFlagCompressed = 0x02,
+    // Entry contains central directory of the archive instead of a file. It is always
+    // written together with kEntryFlagDeleted, so a linear scan skips it.
+    kEntryFlagCentralDirectory = 0x04,
+    // Path is followed by uint16_t size and that many bytes of extra fields.
+    kEntryFlagExtraFields = 0x08,
+    // Entry contains compressed data of multiple small files instead of a file.
+    // Not listed as a file. Marked deleted when all its files are deleted.
+    kEntryFlagSolidBlock = 0x10,
+    // File without own data. Its data is part of the nearest kEntryFlagSolidBlock
+    // entry before it, at offset from kExtraFieldSolidOffset.
+    kEntryFlagSolid = 0x20,
+    // Entry contains stored dictionary for zlib streams of other entries instead of
+    // a file. Not listed as a file. Precedes entries that use it.
+    kEntryFlagDictionary = 0x40,
+    // Entry was streamed by MemPacker, which can't seek back, so pack_size and CRC-32 in
+    // its header are 0, and so is unp_size of compressed data if it wasn't known in advance.
+    // Their values follow the data in DataDescriptor. Central directory has them as well.
+    kEntryFlagDataDescriptor = 0x80,
+};
+
+// Each extra field is: uint16_t tag, uint16_t size, size bytes of data.
+enum ExtraFieldTag : uint16_t
+{
+    // uint32_t CRC-32 of unpacked data.
+    kExtraFieldCrc32 = 1,
+    // uint8_t CodecId of compressed data. Missing means kCodecZlib.
+    kExtraFieldCodec = 2,
+    // uint32_t offset of the data of a kEntryFlagSolid file in unpacked solid block.
+    kExtraFieldSolidOffset = 3,
+    // uint32_t ID of a kEntryFlagDictionary entry, or of the dictionary used by
+    // compressed data of this entry. IDs start from 1.
+    kExtraFieldDictionaryId = 4,
+    // uint64_t distance in unpacked data between seek points of a compressed entry,
+    // then uint64_t offset in packed data of each seek point: at unpacked offset
+    // distance, 2 * distance, and so on. Compressor was flushed there, so decoding
+    // can start at them. Offsets are 0 if not known, like in an entry header with
+    // kEntryFlagDataDescriptor.
+    kExtraFieldSeekTable = 5,
+    // uint64_t ContentHasher hash of unpacked data of a file with own data, so later
+    // files with the same content can refer to it. 0 in the entry header of a file with
+    // kEntryFlagDataDescriptor, until a duplicate refers to it.
+    kExtraFieldContentHash = 6,
+    // uint64_t content hash of a file without own data. Its data is the data of an
+    // earlier entry with the same unp_size, CRC-32 and kExtraFieldContentHash. That
+    // entry may be deleted, then it stays in the archive until its duplicates are deleted.
+    kExtraFieldDuplicateOf = 7,
+};
+
+// Known extra fields of an entry. Unknown ones are skipped when parsing.
+struct EntryExtra
+{
+    bool has_crc32 = false;
+    uint32_t crc32 = 0;
+    CodecId codec = kCodecZlib;
+    uint32_t solid_offset = 0;
+    // 0 if none.
+    uint32_t dictionary_id = 0;
+    // 0 if there are no seek points.
+    uint64_t seek_interval = 0;
+    std::vector<uint64_t> seek_offsets;
+    // 0 if none or not known.
+    uint64_t content_hash = 0;
+    // 0 if the entry is not a duplicate.
+    uint64_t duplicate_of = 0;
 };
 
 #pragma pack(push, 1)
@@ -49,8 +115,68 @@ struct EntryHeader
     // Length of the path.
     uint16_t path_len;
 };
+
+// Follows data of an entry with kEntryFlagDataDescriptor.
+struct DataDescriptor
+{
+    // kDataDescriptorMagic.
+    uint32_t magic;
+    // CRC-32 of unpacked data.
+    uint32_t crc32;
+    // Packed data size in archive, in bytes.
+    uint64_t pack_size;
+    // Original (unpacked) data size, in bytes.
+    uint64_t unp_size;
+};
+
+/*
+Last bytes of the archive file when it ends with central directory entry.
+Content of that entry is a sequence of records, each being:
+uint64_t entry offset, EntryHeader, path_len wchar_t characters of the path,
+extra fields with their uint16_t size if kEntryFlagExtraFields is set,
+followed by this structure.
+*/
+struct CentralDirectoryTrailer
+{
+    // Offset of the EntryHeader of the central directory entry.
+    uint64_t entry_offset;
+    // Number of records in the central directory.
+    uint64_t record_count;
+    // kCentralDirectoryMagic.
+    uint32_t magic;
+};
 #pragma pack(pop)
 
+// Entry of the archive as described by the central directory.
+struct IndexEntry
+{
+    // Offset of the EntryHeader from the beginning of the archive file.
+    uint64_t offset;
+    EntryHeader header;
+    std::wstring path;
+    // Raw extra fields, not including their size.
+    std::vector<char> extra_fields;
+};
+
+// Returns size of EntryHeader with path and extra fields, which is offset of
+// entry data from its beginning.
+inline uint64_t GetEntryHeaderSize(const EntryHeader& header, size_t extra_fields_size)
+{
+    uint64_t size = sizeof(EntryHeader) + header.path_len * sizeof(wchar_t);
+    if(header.flags & kEntryFlagExtraFields)
+        size += sizeof(uint16_t) + extra_fields_size;
+    return size;
+}
+
+// Returns size of entry data in the archive file, including DataDescriptor after it.
+inline uint64_t GetEntryDataSize(const EntryHeader& header)
+{
+    uint64_t size = header.pack_size;
+    if(header.flags & kEntryFlagDataDescriptor)
+        size += sizeof(DataDescriptor);
+    return size;
+}
+
 extern tProcessDataProcW g_global_process_data_proc;
 
 class ArchiveBase
@@ -66,26 +192,83 @@ protected:
 
     tProcessDataProcW process_data_proc_ = nullptr;
     UniqueFilePtr archive_file_;
+    // Archive opened only for reading is also mapped to memory, if possible.
+    // Then functions ReadArchive* use it instead of archive_file_.
+    MappedFile archive_mapping_;
+    // Cursor in archive_mapping_.
+    uint64_t mapped_offset_ = 0;
     uint64_t original_archive_size_ = 0;
     uint64_t bytes_processed_since_previous_progress_ = 0;
     uint64_t last_progress_time_ = 0;
     EntryHeader last_header_ = {};
     std::wstring last_header_path_;
+    std::vector<char> last_header_extra_fields_;
+    // True if the archive begins with file header of version 1.00, which doesn't
+    // allow extra fields.
+    bool old_file_header_ = false;
+    // All entries of the archive in file order, including deleted ones.
+    std::vector<IndexEntry> index_;
+    // True if index_ was loaded from central directory stored in the archive.
+    // Otherwise it is filled during linear scan in DeleteIf.
+    bool has_central_directory_ = false;
+    // Offset where entries end: beginning of the central directory entry or end of file.
+    uint64_t data_end_offset_ = 0;
+    // Reused by all entries, also by jobs of thread pools of derived classes, which
+    // are destroyed first.
+    BufferPool buffer_pool_;
+    CodecPool codec_pool_;
+    // Sizes buffers for entry data. Created when the archive is opened for packing or extraction.
+    std::unique_ptr<IoBufferSizer> io_buffer_sizer_;
 
     // Returns 0 if user pressed Cancel button.
     int CallProcessDataProc(wchar_t* file_name, int size);
     // Returns true if user pressed Cancel button.
     bool UpdateBytesProcessedProgress();
     bool UpdateDirectProgress(wchar_t* file_name, int size);
+    // Like fread(), returns number of bytes read, less than size at the end of file.
+    size_t ReadArchive(void* dst_buf, size_t size);
+    // Reads size bytes and returns pointer to them - directly inside archive_mapping_
+    // or to tmp_buf, filled from archive_file_. Throws exception on error or end of file.
+    const char* ReadArchiveData(std::vector<char>& tmp_buf, size_t size);
+    void SeekArchive(int64_t offset, int origin);
+    uint64_t TellArchive();
     // Reads and checks the main file format header. If invalid, throws exception.
     void ReadAndCheckHeader();
-    // Uses archive_file_ to read header into last_header_.
-    // Returns false if end of file was reached and the header was not read.
+    // Uses archive_file_ to read header into last_header_, last_header_path_,
+    // last_header_extra_fields_. Returns false if end of file was reached and the header was not read.
+    // With kEntryFlagDataDescriptor, pack_size and CRC-32 are filled from DataDescriptor.
     bool ReadEntryHeader();
+    // Finds DataDescriptor after data of last_header_ and fills pack_size and CRC-32 from it.
+    // Leaves the cursor at the beginning of the data.
+    void ReadDataDescriptor();
+    // Tries to load index_ from central directory at the end of archive_file_.
+    // Returns false if there is none or it is invalid. Preserves the cursor.
+    bool ReadCentralDirectory();
+    // Writes index_ as central directory at data_end_offset_ and truncates the file after it.
+    void WriteCentralDirectory();
+    // Sets kEntryFlagDeleted in index_ and in headers inside the file of entries at given
+    // positions of index_. Headers are written in order of their offsets, in one pass.
+    void MarkEntriesDeleted(std::vector<size_t> entry_indices);
+    // Marks deleted solid blocks of index_ whose files are all deleted.
+    void MarkUnusedSolidBlocksDeleted();
+    // Returns flags telling which deleted entries of index_ still hold data of duplicates
+    // that are not deleted, so they must stay in the archive.
+    std::vector<bool> FindDeletedEntriesInUse() const;
+    // Returns true if deleted entries take enough space in the archive to be worth Compact.
+    bool ShouldCompact() const;
+    // Copies non-deleted entries of index_ with central directory to a temporary file,
+    // which then replaces the archive at archive_path, and reopens archive_file_. Updates
+    // index_, data_end_offset_ and has_central_directory_. The archive is not modified
+    // until it is replaced. If the copy fails, e.g. for lack of disk space, the archive
+    // stays as it is. When user presses Cancel, central directory of the archive is
+    // written and E_EABORTED thrown.
+    void Compact(const wstr_view& archive_path);
     // archive_file_ is open for read and write. Cursor is at the beginning of an
     // entry. Loop over all entries until the end of archive. For each entry, if
     // predicate returns true, mark this entry as deleted. Predicate should read
-    // last_header_.
+    // last_header_. Uses central directory if loaded, otherwise builds index_ and
+    // data_end_offset_ by a read-only scan. Matching entries are marked after all are
+    // found, so the archive is not modified if user presses Cancel.
     template<typename Pred>
     void DeleteIf(Pred pred);
 };
@@ -96,6 +279,12 @@ public:
     void OpenArchiveW(tOpenArchiveDataW* archiveData);
     int ReadHeaderExW(tHeaderDataExW* headerData);
     int ProcessFileW(int operation, wchar_t* destPath, wchar_t* destName);
+    // Unpacks up to size bytes of the file last returned by ReadHeaderExW, starting at
+    // offset, without processing the whole file. Returns number of bytes unpacked, less
+    // than size only at the end of the file. Decoding of a compressed file starts at
+    // the last seek point before offset, if it has any. CRC-32 is not checked.
+    // Preserves the cursor, so the file can then be processed by ProcessFileW.
+    size_t ReadFileRange(uint64_t offset, char* dst, size_t size);
 
 private:
     enum class ArchiveMode
@@ -104,10 +293,92 @@ private:
         kExtract,
         kCount
     } mode_;
+    // Index of the next entry in index_ to be returned by ReadHeaderExW, when
+    // has_central_directory_.
+    size_t next_index_entry_ = 0;
+    // Offset of the data of the entry last returned by ReadHeaderExW.
+    uint64_t last_content_offset_ = 0;
+    // Last kEntryFlagSolidBlock entry passed by ReadHeaderExW. Its offset is
+    // UINT64_MAX if there was none.
+    IndexEntry last_solid_block_ = { UINT64_MAX };
+    // Unpacked data of the solid block at offset solid_block_data_offset_, shared
+    // with extraction jobs.
+    std::shared_ptr<const std::vector<char>> solid_block_data_;
+    uint64_t solid_block_data_offset_ = UINT64_MAX;
+
+    // kEntryFlagDictionary entry passed by ReadHeaderExW.
+    struct Dictionary
+    {
+        uint32_t id;
+        IndexEntry entry;
+        // Loaded on first use, shared with extraction jobs.
+        std::shared_ptr<const std::vector<char>> data;
+    };
+    std::vector<Dictionary> dictionaries_;
+    // Entries with own data that duplicates can refer to, by content hash. During
+    // linear scan filled by ReadHeaderExW, otherwise from index_ on first use.
+    std::unordered_multimap<uint64_t, IndexEntry> content_entries_;
+    bool content_entries_loaded_ = false;
+
+    // Extraction job running on thread_pool_.
+    struct PendingExtraction
+    {
+        std::wstring dest_path;
+        std::future<void> done;
+    };
+
+    std::deque<PendingExtraction> pending_extractions_;
+    // Progress of extraction jobs, not yet passed to bytes_processed_since_previous_progress_.
+    std::atomic<uint64_t> async_bytes_processed_ = 0;
+    std::atomic<bool> extraction_cancelled_ = false;
+    // Threads writing extracted files and reading the archive ahead, used by jobs of
+    // thread_pool_ too. Null in list mode or if kEnableExtractPipeline is off.
+    std::unique_ptr<ThreadPool> pipeline_thread_pool_;
+    // Declared last, so it waits for the jobs before other members are destroyed.
+    std::unique_ptr<ThreadPool> thread_pool_;
 
+    // Remembers solid block or dictionary entry passed by ReadHeaderExW.
+    void PassInternalEntry(const IndexEntry& entry);
+    // Moves cursor to data of the entry last returned by ReadHeaderExW.
+    void SeekToLastEntryData();
+    // If extra describes a duplicate, replaces header and extra with those of the entry
+    // holding its data, keeping unp_size and CRC-32, moves the cursor to that data and
+    // returns true.
+    bool SeekToDuplicateData(EntryHeader& header, EntryExtra& extra);
+    // Returns data of a dictionary passed by ReadHeaderExW, loading it if needed.
+    // Preserves the cursor.
+    std::shared_ptr<const std::vector<char>> GetDictionary(uint32_t id);
+    // Unpacks last_solid_block_ to solid_block_data_, unless it is already there.
+    // Preserves the cursor.
+    void LoadSolidBlock();
+    // Directories are always created immediately.
     void ExtractFile(const wstr_view& dest_path, const wstr_view& dest_name);
-    void UnpackFileContent(FILE* dst_file, FILE* src_file,
-        uint64_t dst_file_size, uint64_t src_file_size, bool enable_compression);
+    // Unpacks data of last entry and checks its CRC-32, writing it to full_dest_path
+    // or only testing it if full_dest_path is empty. It is done by a job on
+    // thread_pool_ when the archive is mapped to memory, otherwise synchronously.
+    void ProcessFileData(const std::wstring& full_dest_path);
+    // Used on both the main thread and worker threads, so it uses only thread-safe
+    // members: pipeline_thread_pool_, buffer_pool_, codec_pool_, io_buffer_sizer_.
+    // read_src(inout_size) returns pointer to next packed data, at most inout_size
+    // bytes, and sets inout_size to the number of bytes returned, never 0.
+    // progress(bytes) accounts processed bytes and returns true if the operation
+    // was cancelled. Unpacked data of a compressed entry is written by a job on
+    // pipeline_thread_pool_, or synchronously if it is null. Stored data is written
+    // synchronously from the pointer returned by read_src.
+    template<typename ReadSrcFunc, typename ProgressFunc>
+    void ExtractFileData(const std::wstring& full_dest_path,
+        const EntryHeader& header, const EntryExtra& extra, std::span<const char> dictionary,
+        ReadSrcFunc read_src, ProgressFunc progress);
+    // write_dst(data, size) is called with unpacked data. Thread-safe like ExtractFileData.
+    template<typename WriteDstFunc, typename ReadSrcFunc, typename ProgressFunc>
+    void UnpackFileContent(uint32_t& out_crc32, WriteDstFunc write_dst,
+        uint64_t dst_file_size, uint64_t src_file_size, bool enable_compression, CodecId codec,
+        std::span<const char> dictionary, ReadSrcFunc read_src, ProgressFunc progress);
+    // Like UpdateBytesProcessedProgress, but also reports progress of extraction jobs
+    // and cancels them when user pressed Cancel button.
+    bool UpdateProgress();
+    // Waits until at most max_pending extraction jobs remain. Rethrows their errors.
+    void WaitForExtractions(size_t max_pending);
     // On failure does nothing, not throwing exception.
     static void SetFileTime(const wstr_view& file_path, uint32_t file_time);
 };
@@ -120,18 +391,126 @@ public:
 
 private:
     bool created_new_archive_ = false;
+    // Created on first use by PackFileContentParallel.
+    std::unique_ptr<ThreadPool> thread_pool_;
+    // Threads reading source files ahead and writing the archive behind. Created by
+    // PackFilesW, null if kEnablePackPipeline is off.
+    std::unique_ptr<ThreadPool> pipeline_thread_pool_;
+
+    // Small file waiting to be written after its solid block.
+    struct PendingSolidFile
+    {
+        EntryHeader header;
+        std::wstring path;
+        uint32_t offset;
+        uint32_t crc32;
+    };
+    std::vector<PendingSolidFile> solid_files_;
+    // Unpacked data of solid_files_.
+    std::vector<char> solid_block_data_;
+    // Dictionary used for new zlib streams, empty if none.
+    std::vector<char> dictionary_;
+    uint32_t dictionary_id_ = 0;
+    // Reused by WriteEntryHeader.
+    std::vector<char> header_buf_;
+    // Positions in index_ of entries that duplicates can refer to, by unp_size.
+    std::unordered_multimap<uint64_t, size_t> content_entries_;
+    // Positions in index_ of entries referred to by new duplicates, whose headers in the
+    // file may still have content hash 0.
+    std::vector<size_t> content_hashes_to_write_;
+    // Offset of the entry of dictionary_, which must precede entries using it.
+    uint64_t dictionary_offset_ = 0;
+
+    // Space of adjacent deleted entries that new entries can be moved into.
+    struct FreeExtent
+    {
+        uint64_t size;
+        // Positions in index_ of the deleted entries taking the space, in file order.
+        std::vector<size_t> entries;
+        // True if a solid file that is not deleted follows before the next solid block,
+        // so a solid block placed here would take it over.
+        bool followed_by_solid_file;
+    };
+    // By offset.
+    std::map<uint64_t, FreeExtent> free_extents_;
+    // Offsets of free_extents_ by their size.
+    std::multimap<uint64_t, uint64_t> free_extent_offsets_by_size_;
+    // Positions in index_ of deleted entries overwritten by moved entries.
+    std::vector<size_t> reused_entries_;
 
     // Opens archive_file_ for writing. Also sets original_archive_size_ and created_new_archive_.
     void OpenForPack(const wstr_view& archive_path);
+    // Marks deleted the file entries of index_ for which
+    // is_replaced(path, header, extra_fields) returns true. Entries are passed without
+    // copying them, and only flags of the matching ones are written.
+    template<typename Pred>
+    void MarkReplacedEntriesDeleted(Pred is_replaced);
+    // Returns true if the file at absolute_path has the same size, time and attributes
+    // as in the entry, and with kVerifyUnchangedFileContent also the same content.
+    // Returns false if the file can't be read, so PackFile reports the error.
+    bool IsFileUnchanged(const EntryHeader& header, const std::vector<char>& extra_fields,
+        const wstr_view& absolute_path);
+    // Fills content_entries_ from index_.
+    void LoadContentEntries();
+    // Returns index of an entry with unp_size, crc32 and content_hash, or SIZE_MAX if there is none.
+    size_t FindContentEntry(uint64_t unp_size, uint32_t crc32, uint64_t content_hash) const;
+    // Writes entry of a duplicate referring to target_entry at the current position.
+    void PackDuplicateFile(EntryHeader& header, const std::wstring& path, uint32_t crc32, uint64_t content_hash,
+        size_t target_entry);
+    // Writes content hashes of content_hashes_to_write_ to their entry headers.
+    void WriteContentHashes();
+    // Fills free_extents_ from deleted entries of index_ that are not in use.
+    void LoadFreeExtents();
+    // Ignores extents too small to be reused.
+    void AddFreeExtent(uint64_t offset, FreeExtent&& extent);
+    void RemoveFreeExtent(std::map<uint64_t, FreeExtent>::iterator it);
+    // Takes deleted entry at entry_index in index_ out of free_extents_, because a new
+    // duplicate refers to it. Does nothing if it is not there.
+    void ReserveDeletedEntry(size_t entry_index);
+    // Entries of index_ from first_entry on were just written from begin_offset to the
+    // cursor, at the end of the archive. If a free extent beginning after min_offset
+    // fits them, moves them there and moves the cursor back to begin_offset. The rest of
+    // the extent becomes a smaller one. Does nothing if free_extents_ is empty.
+    void MoveToFreeSpace(size_t first_entry, uint64_t begin_offset, uint64_t min_offset, bool is_solid_block);
+    // Removes reused_entries_ from index_ and sorts it by offset. Positions in index_
+    // stored in other members are no longer valid.
+    void RemoveReusedEntries();
+    // Called when packing fails or is cancelled. Keeps entries written completely, up to
+    // data_end_offset_: truncates the rest of the file and writes central directory.
+    void CloseFailedPack();
+    // Opens source file for reading ahead. Returns null on failure.
+    std::unique_ptr<ReadAheadFile> OpenSrcFile(const wstr_view& absolute_path);
+    // src_file is the file at absolute_path opened by OpenSrcFile, or null to open it here.
     void PackFile(bool& out_is_directory, const wstr_view& absolute_path,
-        const wstr_view& archive_path, bool save_paths);
+        const wstr_view& archive_path, bool save_paths, std::unique_ptr<ReadAheadFile> src_file);
+    // Loads dictionary_ from the archive. If there is none, trains it from beginnings of
+    // small files to pack and writes it as an entry at the cursor.
+    void PrepareDictionary(const wstr_view& src_path, std::span<const std::wstring> relative_paths);
+    // Reads small file to solid_block_data_. Writes the block if it is full.
+    void AddSolidFile(const EntryHeader& header, std::wstring&& path, ReadAheadFile& src_file);
+    // Writes solid block entry with solid_block_data_, followed by entries of solid_files_.
+    void FlushSolidBlock();
     void DeleteSrcFile(const wstr_view& path, bool is_directory);
     // Fills members: UnpSize, Time, Flags.
     static void GetFileAttributes(EntryHeader& header, const wstr_view& full_path);
-    void WriteEntryHeader(const EntryHeader& header, const wstr_view& path);
+    void WriteEntryHeader(const EntryHeader& header, const wstr_view& path,
+        const std::vector<char>& extra_fields);
+    // out_crc32 and out_content_hash are CRC-32 and ContentHasher hash of data read from
+    // src_file. codec and dictionary are used
+    // if enable_compression. If seek_interval is not 0, compressor is flushed at each
+    // multiple of it before the end of data, and out_seek_offsets receives offsets
+    // of these points in written data.
     void PackFileContent(
-        uint64_t& out_bytes_written, uint64_t& out_bytes_read,
-        FILE* dst_file, FILE* src_file, uint64_t src_file_size, bool enable_compression);
+        uint64_t& out_bytes_written, uint64_t& out_bytes_read, uint32_t& out_crc32,
+        uint64_t& out_content_hash, std::vector<uint64_t>& out_seek_offsets,
+        FILE* dst_file, ReadAheadFile& src_file, uint64_t src_file_size, bool enable_compression, CodecId codec,
+        std::span<const char> dictionary, uint64_t seek_interval);
+    // Compresses blocks of the file on multiple threads, producing single zlib stream.
+    // seek_interval must be a multiple of kParallelCompressionBlockSize.
+    void PackFileContentParallel(
+        uint64_t& out_bytes_written, uint64_t& out_bytes_read, uint32_t& out_crc32,
+        ContentHasher& content_hasher, std::vector<uint64_t>& out_seek_offsets,
+        FILE* dst_file, ReadAheadFile& src_file, uint64_t src_file_size, uint64_t seek_interval);
 };
 
 class DeletingArchive : public ArchiveBase
@@ -140,8 +519,6 @@ public:
     int DeleteFilesW(wchar_t *packedFile, wchar_t *deleteList);
 
 private:
-    static bool ShouldDelete(const wstr_view& curr_path, std::span<const std::wstring> paths_to_delete);
-
     void OpenForDelete(const wstr_view& archive_path);
 };
 
@@ -150,3 +527,36 @@ class HeaderCheckingArchive : public ArchiveBase
 public:
     BOOL CanYouHandleThisFileW(const wchar_t* filePath);
 };
+
+/*
+Packs one file passed in memory, returning packed data in memory, with no files
+involved. With MEM_OPTIONS_WANTHEADERS, the output is a whole archive containing an
+entry with kEntryFlagDataDescriptor and central directory, otherwise only the
+compressed stream. Objects are independent, so they can be used on multiple threads.
+*/
+class MemPacker
+{
+public:
+    // file_name is the name of the packed file. Its path is not stored.
+    MemPacker(int options, const wstr_view& file_name);
+    // Takes all of src, or nothing while output of previous calls is still pending,
+    // and returns as much output as fits in dst. src_size = 0 means the end of data.
+    // Returns MEMPACK_DONE when all output has been returned, otherwise MEMPACK_OK.
+    int PackToMem(const char* src, size_t src_size, size_t& out_taken,
+        char* dst, size_t dst_capacity, size_t& out_written);
+
+private:
+    const bool want_headers_;
+    // Declared before compressor_, which it must outlive.
+    CodecPool codec_pool_;
+    CodecPool::CompressorPtr compressor_;
+    // Entry as it goes to central directory.
+    IndexEntry entry_ = {};
+    uint32_t crc32_ = 0;
+    bool finished_ = false;
+    // Output not yet returned, starting at pending_offset_.
+    std::vector<char> pending_;
+    size_t pending_offset_ = 0;
+
+    void Compress(const char* src, size_t src_size, bool is_last);
+};
@@ -0,0 +1,265 @@
+/*
+MIT License
+
+Copyright (c) 2025 Adam Sawicki, https://asawicki.info
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "precompiled_header.hpp"
+#include "checksum.hpp"
+#include "third_party/zlib-1.3.1/zlib.h"
+#include <intrin.h>
+#include <bit>
+
+#if defined(_M_X64)
+
+static bool CpuSupportsPclmul()
+{
+    int info[4];
+    __cpuid(info, 1);
+    const bool pclmulqdq = (info[2] & (1 << 1)) != 0;
+    const bool sse41 = (info[2] & (1 << 19)) != 0;
+    return pclmulqdq && sse41;
+}
+
+/*
+Folds data with carry-less multiplication, 64 bytes per iteration, then reduces
+the result with Barrett reduction, as described in Intel paper "Fast CRC
+Computation for Generic Polynomials Using PCLMULQDQ Instruction". size must be
+at least 64 and a multiple of 16. crc is not inverted at input or output.
+*/
+static uint32_t Crc32FoldPclmul(uint32_t crc, const uint8_t* data, size_t size)
+{
+    // Constants for reflected polynomial 0xEDB88320.
+    const __m128i k1k2 = _mm_set_epi64x(0x1C6E41596, 0x154442BD4);
+    const __m128i k3k4 = _mm_set_epi64x(0x0CCAA009E, 0x1751997D0);
+    const __m128i k5 = _mm_set_epi64x(0, 0x163CD6124);
+    const __m128i poly_mu = _mm_set_epi64x(0x1F7011641, 0x1DB710641);
+    const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+
+    auto fold = [](__m128i x, __m128i k, __m128i next) -> __m128i
+    {
+        const __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+        const __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+        return _mm_xor_si128(_mm_xor_si128(lo, hi), next);
+    };
+
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    data += 64;
+    size -= 64;
+
+    while(size >= 64)
+    {
+        x1 = fold(x1, k1k2, _mm_loadu_si128((const __m128i*)(data + 0x00)));
+        x2 = fold(x2, k1k2, _mm_loadu_si128((const __m128i*)(data + 0x10)));
+        x3 = fold(x3, k1k2, _mm_loadu_si128((const __m128i*)(data + 0x20)));
+        x4 = fold(x4, k1k2, _mm_loadu_si128((const __m128i*)(data + 0x30)));
+        data += 64;
+        size -= 64;
+    }
+
+    // Fold 4 x 128 bits into 128 bits.
+    x1 = fold(x1, k3k4, x2);
+    x1 = fold(x1, k3k4, x3);
+    x1 = fold(x1, k3k4, x4);
+
+    while(size >= 16)
+    {
+        x1 = fold(x1, k3k4, _mm_loadu_si128((const __m128i*)data));
+        data += 16;
+        size -= 16;
+    }
+
+    // Fold 128 bits into 64 bits.
+    x2 = _mm_clmulepi64_si128(k3k4, x1, 0x01);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    // Fold 64 bits into 32 bits.
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, k5, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction.
+    x2 = x1;
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, poly_mu, 0x10);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, poly_mu, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+uint32_t Crc32(uint32_t crc, const void* data, size_t size)
+{
+    static const bool use_pclmul = CpuSupportsPclmul();
+
+    const uint8_t* bytes = (const uint8_t*)data;
+    if(use_pclmul && size >= 64)
+    {
+        const size_t fold_size = size & ~(size_t)15;
+        crc = ~Crc32FoldPclmul(~crc, bytes, fold_size);
+        bytes += fold_size;
+        size -= fold_size;
+    }
+    if(size > 0)
+        crc = (uint32_t)crc32_z(crc, bytes, size);
+    return crc;
+}
+
+#elif defined(_M_ARM64)
+
+uint32_t Crc32(uint32_t crc, const void* data, size_t size)
+{
+    static const bool use_crc32_instructions =
+        IsProcessorFeaturePresent(PF_ARM_V8_CRC32_INSTRUCTIONS_AVAILABLE) != FALSE;
+    if(!use_crc32_instructions)
+        return (uint32_t)crc32_z(crc, (const Bytef*)data, size);
+
+    const uint8_t* bytes = (const uint8_t*)data;
+    crc = ~crc;
+    for(; size >= 8; bytes += 8, size -= 8)
+    {
+        uint64_t value;
+        memcpy(&value, bytes, sizeof(value));
+        crc = __crc32d(crc, value);
+    }
+    for(; size > 0; ++bytes, --size)
+        crc = __crc32b(crc, *bytes);
+    return ~crc;
+}
+
+#else
+
+uint32_t Crc32(uint32_t crc, const void* data, size_t size)
+{
+    return (uint32_t)crc32_z(crc, (const Bytef*)data, size);
+}
+
+#endif
+
+static const uint64_t kXxhPrime1 = 0x9E3779B185EBCA87ull;
+static const uint64_t kXxhPrime2 = 0xC2B2AE3D27D4EB4Full;
+static const uint64_t kXxhPrime3 = 0x165667B19E3779F9ull;
+static const uint64_t kXxhPrime4 = 0x85EBCA77C2B2AE63ull;
+static const uint64_t kXxhPrime5 = 0x27D4EB2F165667C5ull;
+
+static inline uint64_t XxhRound(uint64_t acc, uint64_t input)
+{
+    acc += input * kXxhPrime2;
+    acc = std::rotl(acc, 31);
+    return acc * kXxhPrime1;
+}
+
+static inline uint64_t XxhMergeRound(uint64_t acc, uint64_t lane)
+{
+    acc ^= XxhRound(0, lane);
+    return acc * kXxhPrime1 + kXxhPrime4;
+}
+
+static inline uint64_t XxhRead64(const uint8_t* ptr)
+{
+    uint64_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+ContentHasher::ContentHasher() :
+    lanes_{ kXxhPrime1 + kXxhPrime2, kXxhPrime2, 0, 0 - kXxhPrime1 }
+{
+}
+
+void ContentHasher::Update(const void* data, size_t size)
+{
+    if(size == 0)
+        return;
+
+    const uint8_t* bytes = (const uint8_t*)data;
+    total_size_ += size;
+
+    if(buf_size_ > 0)
+    {
+        const size_t copy_size = std::min(size, sizeof(buf_) - buf_size_);
+        memcpy(buf_ + buf_size_, bytes, copy_size);
+        buf_size_ += copy_size;
+        bytes += copy_size;
+        size -= copy_size;
+        if(buf_size_ < sizeof(buf_))
+            return;
+        for(size_t i = 0; i < 4; ++i)
+            lanes_[i] = XxhRound(lanes_[i], XxhRead64(buf_ + i * 8));
+        buf_size_ = 0;
+    }
+
+    for(; size >= sizeof(buf_); bytes += sizeof(buf_), size -= sizeof(buf_))
+    {
+        for(size_t i = 0; i < 4; ++i)
+            lanes_[i] = XxhRound(lanes_[i], XxhRead64(bytes + i * 8));
+    }
+
+    memcpy(buf_, bytes, size);
+    buf_size_ = size;
+}
+
+uint64_t ContentHasher::Finish() const
+{
+    uint64_t hash = 0;
+    if(total_size_ >= sizeof(buf_))
+    {
+        hash = std::rotl(lanes_[0], 1) + std::rotl(lanes_[1], 7) +
+            std::rotl(lanes_[2], 12) + std::rotl(lanes_[3], 18);
+        for(size_t i = 0; i < 4; ++i)
+            hash = XxhMergeRound(hash, lanes_[i]);
+    }
+    else
+        hash = kXxhPrime5;
+    hash += total_size_;
+
+    const uint8_t* ptr = buf_;
+    const uint8_t* const end = buf_ + buf_size_;
+    for(; end - ptr >= 8; ptr += 8)
+    {
+        hash ^= XxhRound(0, XxhRead64(ptr));
+        hash = std::rotl(hash, 27) * kXxhPrime1 + kXxhPrime4;
+    }
+    if(end - ptr >= 4)
+    {
+        uint32_t value;
+        memcpy(&value, ptr, sizeof(value));
+        hash ^= value * kXxhPrime1;
+        hash = std::rotl(hash, 23) * kXxhPrime2 + kXxhPrime3;
+        ptr += 4;
+    }
+    for(; ptr < end; ++ptr)
+    {
+        hash ^= *ptr * kXxhPrime5;
+        hash = std::rotl(hash, 11) * kXxhPrime1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= kXxhPrime2;
+    hash ^= hash >> 29;
+    hash *= kXxhPrime3;
+    hash ^= hash >> 32;
+    return hash;
+}
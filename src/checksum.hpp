@@ -0,0 +1,52 @@
+/*
+MIT License
+
+Copyright (c) 2025 Adam Sawicki, https://asawicki.info
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+/*
+Calculates CRC-32 of data, continuing from crc, same as crc32() function from
+zlib. Start with crc = 0. When CPU supports it, uses carry-less multiplication
+(PCLMULQDQ) on x64 or CRC32 instructions on ARM64, otherwise zlib.
+*/
+uint32_t Crc32(uint32_t crc, const void* data, size_t size);
+
+/*
+Calculates 64-bit XXH64 hash with seed 0 of data passed in any number of pieces.
+Not cryptographic. Used together with size and CRC-32 to find files with equal
+content.
+*/
+class ContentHasher
+{
+public:
+    ContentHasher();
+    void Update(const void* data, size_t size);
+    // Returns hash of all data passed so far.
+    uint64_t Finish() const;
+
+private:
+    uint64_t lanes_[4];
+    uint64_t total_size_ = 0;
+    // Data not yet consumed by lanes_, less than a stripe.
+    uint8_t buf_[32];
+    size_t buf_size_ = 0;
+};
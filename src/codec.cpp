@@ -0,0 +1,928 @@
+/*
+MIT License
+
+Copyright (c) 2025 Adam Sawicki, https://asawicki.info
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "precompiled_header.hpp"
+#include "codec.hpp"
+#include "third_party/zlib-1.3.1/zlib.h"
+#include <bit>
+#include <queue>
+#include <unordered_map>
+
+/*
+Format of kCodecLz stream is a sequence of blocks, each compressing up to
+kLzBlockSize bytes independently of others. Block begins with LzBlockHeader. Its
+data is either stored, or a sequence of LZ4-style sequences: token byte with
+literal length in high 4 bits and match length - kLzMinMatch in low 4 bits,
+additional length bytes if the literal length is 15, literals, uint16_t match
+offset, additional length bytes if the match length is 15. Additional length
+bytes are added to the length until a byte other than 255. Last sequence has
+only literals. Block with unp_size = 0 marks the end of the stream.
+*/
+
+static const size_t kLzBlockSize = 0x10000; // 64 KB
+static const size_t kLzMinMatch = 4;
+static const size_t kLzHashBits = 14;
+// Last bytes of a block are always literals, so the decoder can end on literals.
+static const size_t kLzLastLiterals = 5;
+// Match can't begin closer than this to the end of the block.
+static const size_t kLzMatchStartLimit = 12;
+static const size_t kLzMaxOffset = 0xFFFF;
+// Acceleration: after 2^kLzSkipTrigger positions without a match, the step grows.
+static const uint32_t kLzSkipTrigger = 6;
+static const uint32_t kLzBlockStoredFlag = 0x80000000;
+// Memory allocated by CodecPool::ZlibAlloc begins with its size, padded to keep alignment.
+static const size_t kZlibBlockHeaderSize = alignof(std::max_align_t);
+
+#pragma pack(push, 1)
+struct LzBlockHeader
+{
+    // Number of bytes after decompression. 0 means end of the stream.
+    uint32_t unp_size;
+    // Number of bytes of block data following the header, optionally with
+    // kLzBlockStoredFlag if the data is not compressed.
+    uint32_t pack_size;
+};
+#pragma pack(pop)
+
+static inline uint32_t LzRead32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t LzRead64(const uint8_t* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t LzHash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - kLzHashBits);
+}
+
+// Writes length that didn't fit in the 4 bits of the token.
+static inline uint8_t* LzWriteExtraLength(uint8_t* dst, size_t length)
+{
+    for(; length >= 255; length -= 255)
+        *dst++ = 255;
+    *dst++ = (uint8_t)length;
+    return dst;
+}
+
+// Reads length that didn't fit in the 4 bits of the token. Returns new src.
+static inline const uint8_t* LzReadExtraLength(const uint8_t* src, const uint8_t* src_end, size_t& length)
+{
+    uint8_t b;
+    do
+    {
+        if(src == src_end)
+            throw E_BAD_DATA;
+        b = *src++;
+        length += b;
+    } while(b == 255);
+    return src;
+}
+
+/*
+Compresses one block. Returns size of the output or 0 if it doesn't fit in
+dst_capacity, in which case the block should be stored.
+*/
+static size_t LzCompressBlock(const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_capacity)
+{
+    assert(src_size <= kLzBlockSize);
+
+    // Positions are relative to src. 0 is a valid position, so candidates are always verified.
+    uint16_t hash_table[1 << kLzHashBits] = {};
+    uint8_t* const dst_begin = dst;
+    uint8_t* const dst_end = dst + dst_capacity;
+    size_t anchor = 0;
+
+    // Writes literals from anchor up to pos, followed by a match, if match_length != 0.
+    auto write_sequence = [&](size_t pos, size_t offset, size_t match_length) -> bool
+    {
+        const size_t literal_length = pos - anchor;
+        const size_t max_size = 1 + literal_length / 255 + 1 + literal_length + 2 + match_length / 255 + 1;
+        if(max_size > (size_t)(dst_end - dst))
+            return false;
+        uint8_t* token = dst++;
+        *token = (uint8_t)(std::min<size_t>(literal_length, 15) << 4);
+        if(literal_length >= 15)
+            dst = LzWriteExtraLength(dst, literal_length - 15);
+        memcpy(dst, src + anchor, literal_length);
+        dst += literal_length;
+        if(match_length)
+        {
+            *dst++ = (uint8_t)offset;
+            *dst++ = (uint8_t)(offset >> 8);
+            const size_t length_code = match_length - kLzMinMatch;
+            *token |= (uint8_t)std::min<size_t>(length_code, 15);
+            if(length_code >= 15)
+                dst = LzWriteExtraLength(dst, length_code - 15);
+        }
+        return true;
+    };
+
+    if(src_size > kLzMatchStartLimit)
+    {
+        const size_t match_start_limit = src_size - kLzMatchStartLimit;
+        const size_t match_end_limit = src_size - kLzLastLiterals;
+        size_t pos = 0;
+        uint32_t misses = 0;
+        while(pos < match_start_limit)
+        {
+            const uint32_t value = LzRead32(src + pos);
+            const uint32_t hash = LzHash(value);
+            size_t ref = hash_table[hash];
+            hash_table[hash] = (uint16_t)pos;
+            if(ref >= pos || pos - ref > kLzMaxOffset || LzRead32(src + ref) != value)
+            {
+                pos += 1 + (misses++ >> kLzSkipTrigger);
+                continue;
+            }
+            misses = 0;
+
+            // Extend the match backwards over pending literals.
+            while(pos > anchor && ref > 0 && src[pos - 1] == src[ref - 1])
+            {
+                --pos;
+                --ref;
+            }
+            // Extend forward, 8 bytes at a time.
+            size_t match_length = kLzMinMatch;
+            while(pos + match_length + 8 <= match_end_limit)
+            {
+                const uint64_t diff = LzRead64(src + pos + match_length) ^ LzRead64(src + ref + match_length);
+                if(diff)
+                {
+                    match_length += std::countr_zero(diff) / 8;
+                    goto match_found;
+                }
+                match_length += 8;
+            }
+            while(pos + match_length < match_end_limit && src[pos + match_length] == src[ref + match_length])
+                ++match_length;
+        match_found:
+
+            if(!write_sequence(pos, pos - ref, match_length))
+                return 0;
+            pos += match_length;
+            anchor = pos;
+            // Improves ratio at little cost.
+            if(pos < match_start_limit)
+                hash_table[LzHash(LzRead32(src + pos - 2))] = (uint16_t)(pos - 2);
+        }
+    }
+
+    if(!write_sequence(src_size, 0, 0))
+        return 0;
+    return dst - dst_begin;
+}
+
+// Throws E_BAD_DATA if src is not valid data of a block with dst_size bytes.
+static void LzDecompressBlock(const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_size)
+{
+    const uint8_t* const src_end = src + src_size;
+    uint8_t* const dst_begin = dst;
+    uint8_t* const dst_end = dst + dst_size;
+
+    for(;;)
+    {
+        if(src == src_end)
+            throw E_BAD_DATA;
+        const uint8_t token = *src++;
+
+        size_t literal_length = token >> 4;
+        // Fast path for short literals, most common case.
+        if(literal_length < 15 && src_end - src >= 16 && dst_end - dst >= 16)
+            memcpy(dst, src, 16);
+        else
+        {
+            if(literal_length == 15)
+                src = LzReadExtraLength(src, src_end, literal_length);
+            if(literal_length > (size_t)(src_end - src) || literal_length > (size_t)(dst_end - dst))
+                throw E_BAD_DATA;
+            memcpy(dst, src, literal_length);
+        }
+        src += literal_length;
+        dst += literal_length;
+
+        if(src == src_end)
+            break;
+
+        if(src_end - src < 2)
+            throw E_BAD_DATA;
+        const size_t offset = src[0] | ((size_t)src[1] << 8);
+        src += 2;
+        if(offset == 0 || offset > (size_t)(dst - dst_begin))
+            throw E_BAD_DATA;
+
+        size_t match_length = token & 15;
+        if(match_length == 15)
+            src = LzReadExtraLength(src, src_end, match_length);
+        match_length += kLzMinMatch;
+        if(match_length > (size_t)(dst_end - dst))
+            throw E_BAD_DATA;
+
+        const uint8_t* ref = dst - offset;
+        uint8_t* const match_end = dst + match_length;
+        // Copy 16 bytes at a time may write past the match, but not past the block.
+        // These bytes are overwritten by following sequences.
+        if(dst_end - match_end >= 16)
+        {
+            if(offset < 16)
+            {
+                // Overlapping copy repeats the pattern. Once 16 bytes are written, it
+                // continues from a multiple of offset at least 16 bytes back, which
+                // doesn't overlap.
+                uint8_t* const pattern_end = dst + 16;
+                for(; dst < pattern_end; ++dst, ++ref)
+                    *dst = *ref;
+                ref = dst - (16 + offset - 1) / offset * offset;
+            }
+            while(dst < match_end)
+            {
+                memcpy(dst, ref, 16);
+                dst += 16;
+                ref += 16;
+            }
+        }
+        else
+        {
+            for(; dst < match_end; ++dst, ++ref)
+                *dst = *ref;
+        }
+        dst = match_end;
+    }
+
+    if(dst != dst_end)
+        throw E_BAD_DATA;
+}
+
+class LzCompressor : public Compressor
+{
+public:
+    CodecId GetCodec() const override { return kCodecLz; }
+    void Reset(std::span<const char> dictionary) override;
+    void Compress(std::vector<char>& dst, const char* src, size_t src_size, bool is_last) override;
+    void Flush(std::vector<char>& dst) override;
+
+private:
+    std::vector<char> block_;
+
+    void WriteBlock(std::vector<char>& dst, const char* src, size_t src_size);
+};
+
+void LzCompressor::Reset(std::span<const char> dictionary)
+{
+    if(!dictionary.empty())
+        throw E_NOT_SUPPORTED;
+    block_.clear();
+}
+
+void LzCompressor::Compress(std::vector<char>& dst, const char* src, size_t src_size, bool is_last)
+{
+    // Whole blocks are compressed directly from src.
+    while(src_size > 0)
+    {
+        if(block_.empty() && src_size >= kLzBlockSize)
+        {
+            WriteBlock(dst, src, kLzBlockSize);
+            src += kLzBlockSize;
+            src_size -= kLzBlockSize;
+            continue;
+        }
+        const size_t bytes_to_copy = std::min(src_size, kLzBlockSize - block_.size());
+        block_.insert(block_.end(), src, src + bytes_to_copy);
+        src += bytes_to_copy;
+        src_size -= bytes_to_copy;
+        if(block_.size() == kLzBlockSize)
+        {
+            WriteBlock(dst, block_.data(), block_.size());
+            block_.clear();
+        }
+    }
+
+    if(is_last)
+    {
+        if(!block_.empty())
+        {
+            WriteBlock(dst, block_.data(), block_.size());
+            block_.clear();
+        }
+        const LzBlockHeader end_header = {};
+        const char* end_header_ptr = (const char*)&end_header;
+        dst.insert(dst.end(), end_header_ptr, end_header_ptr + sizeof(end_header));
+    }
+}
+
+void LzCompressor::Flush(std::vector<char>& dst)
+{
+    // Blocks are independent, so only the partial one needs to be written.
+    if(!block_.empty())
+    {
+        WriteBlock(dst, block_.data(), block_.size());
+        block_.clear();
+    }
+}
+
+void LzCompressor::WriteBlock(std::vector<char>& dst, const char* src, size_t src_size)
+{
+    const size_t header_offset = dst.size();
+    dst.resize(header_offset + sizeof(LzBlockHeader) + src_size);
+    uint8_t* const data_ptr = (uint8_t*)dst.data() + header_offset + sizeof(LzBlockHeader);
+
+    LzBlockHeader header = {};
+    header.unp_size = (uint32_t)src_size;
+    // Compressed data must be smaller than stored, otherwise the block is stored.
+    size_t pack_size = LzCompressBlock((const uint8_t*)src, src_size, data_ptr, src_size - 1);
+    if(pack_size == 0)
+    {
+        memcpy(data_ptr, src, src_size);
+        pack_size = src_size;
+        header.pack_size = (uint32_t)pack_size | kLzBlockStoredFlag;
+    }
+    else
+        header.pack_size = (uint32_t)pack_size;
+
+    memcpy(dst.data() + header_offset, &header, sizeof(header));
+    dst.resize(header_offset + sizeof(LzBlockHeader) + pack_size);
+}
+
+class LzDecompressor : public Decompressor
+{
+public:
+    CodecId GetCodec() const override { return kCodecLz; }
+    void Reset(std::span<const char> dictionary) override;
+    void ResetAtSeekPoint() override { Reset({}); }
+    size_t Decompress(const char*& src, size_t& src_size, char* dst, size_t dst_capacity) override;
+    bool IsFinished() const override { return finished_ && output_offset_ == output_.size(); }
+
+private:
+    bool finished_ = false;
+    bool has_header_ = false;
+    LzBlockHeader header_ = {};
+    // Part of header or block data collected from multiple calls.
+    std::vector<char> input_;
+    // Block decompressed, but not yet returned because dst was too small.
+    std::vector<char> output_;
+    size_t output_offset_ = 0;
+
+    // Returns pointer to size bytes of input, directly in src if possible, or
+    // null if there is not enough input yet.
+    const char* GetInput(size_t size, const char*& src, size_t& src_size);
+};
+
+void LzDecompressor::Reset(std::span<const char> dictionary)
+{
+    if(!dictionary.empty())
+        throw E_NOT_SUPPORTED;
+    finished_ = false;
+    has_header_ = false;
+    header_ = {};
+    input_.clear();
+    output_.clear();
+    output_offset_ = 0;
+}
+
+const char* LzDecompressor::GetInput(size_t size, const char*& src, size_t& src_size)
+{
+    if(input_.empty() && src_size >= size)
+    {
+        const char* ptr = src;
+        src += size;
+        src_size -= size;
+        return ptr;
+    }
+    const size_t bytes_to_copy = std::min(src_size, size - input_.size());
+    input_.insert(input_.end(), src, src + bytes_to_copy);
+    src += bytes_to_copy;
+    src_size -= bytes_to_copy;
+    return input_.size() == size ? input_.data() : nullptr;
+}
+
+size_t LzDecompressor::Decompress(const char*& src, size_t& src_size, char* dst, size_t dst_capacity)
+{
+    size_t bytes_written = 0;
+    for(;;)
+    {
+        if(output_offset_ < output_.size())
+        {
+            const size_t bytes_to_copy = std::min(output_.size() - output_offset_, dst_capacity - bytes_written);
+            memcpy(dst + bytes_written, output_.data() + output_offset_, bytes_to_copy);
+            output_offset_ += bytes_to_copy;
+            bytes_written += bytes_to_copy;
+            if(output_offset_ < output_.size())
+                return bytes_written;
+        }
+        if(finished_)
+            return bytes_written;
+
+        if(!has_header_)
+        {
+            const char* header_ptr = GetInput(sizeof(LzBlockHeader), src, src_size);
+            if(!header_ptr)
+                return bytes_written;
+            memcpy(&header_, header_ptr, sizeof(header_));
+            input_.clear();
+            if(header_.unp_size == 0)
+            {
+                finished_ = true;
+                continue;
+            }
+            const size_t pack_size = header_.pack_size & ~kLzBlockStoredFlag;
+            if(header_.unp_size > kLzBlockSize || pack_size > kLzBlockSize ||
+                ((header_.pack_size & kLzBlockStoredFlag) != 0 && pack_size != header_.unp_size))
+                throw E_BAD_DATA;
+            has_header_ = true;
+        }
+
+        const bool is_stored = (header_.pack_size & kLzBlockStoredFlag) != 0;
+        const size_t pack_size = header_.pack_size & ~kLzBlockStoredFlag;
+        const char* data_ptr = GetInput(pack_size, src, src_size);
+        if(!data_ptr)
+            return bytes_written;
+
+        // Decompressed directly to dst if it fits.
+        char* block_dst = dst + bytes_written;
+        if(dst_capacity - bytes_written < header_.unp_size)
+        {
+            output_.resize(header_.unp_size);
+            output_offset_ = 0;
+            block_dst = output_.data();
+        }
+        else
+            bytes_written += header_.unp_size;
+
+        if(is_stored)
+            memcpy(block_dst, data_ptr, pack_size);
+        else
+            LzDecompressBlock((const uint8_t*)data_ptr, pack_size, (uint8_t*)block_dst, header_.unp_size);
+        input_.clear();
+        has_header_ = false;
+    }
+}
+
+class ZlibCompressor : public Compressor
+{
+public:
+    ZlibCompressor(std::span<const char> dictionary, CodecPool* memory_pool);
+    CodecId GetCodec() const override { return kCodecZlib; }
+    void Reset(std::span<const char> dictionary) override;
+    void Compress(std::vector<char>& dst, const char* src, size_t src_size, bool is_last) override;
+    void Flush(std::vector<char>& dst) override;
+
+private:
+    z_stream zlib_stream_ = {};
+    std::unique_ptr<z_stream, DeflateEndDeleter> zlib_stream_ptr_;
+
+    void SetDictionary(std::span<const char> dictionary);
+    // Calls deflate with flush mode until it consumes all input and returns all output it can.
+    void Deflate(std::vector<char>& dst, int flush);
+};
+
+ZlibCompressor::ZlibCompressor(std::span<const char> dictionary, CodecPool* memory_pool)
+{
+    if(memory_pool)
+        memory_pool->SetZlibAllocator(zlib_stream_);
+    const int zlib_result = deflateInit(&zlib_stream_, Z_DEFAULT_COMPRESSION);
+    ZlibResultToWcxException(zlib_result);
+    zlib_stream_ptr_.reset(&zlib_stream_);
+    SetDictionary(dictionary);
+}
+
+void ZlibCompressor::Reset(std::span<const char> dictionary)
+{
+    // Keeps the allocated state, unlike deflateEnd + deflateInit.
+    const int zlib_result = deflateReset(&zlib_stream_);
+    ZlibResultToWcxException(zlib_result);
+    SetDictionary(dictionary);
+}
+
+void ZlibCompressor::SetDictionary(std::span<const char> dictionary)
+{
+    // Adler-32 of the dictionary is stored in zlib header.
+    if(!dictionary.empty())
+    {
+        const int zlib_result = deflateSetDictionary(&zlib_stream_, (const Bytef*)dictionary.data(), (uInt)dictionary.size());
+        ZlibResultToWcxException(zlib_result);
+    }
+}
+
+void ZlibCompressor::Compress(std::vector<char>& dst, const char* src, size_t src_size, bool is_last)
+{
+    zlib_stream_.next_in = (Bytef*)src;
+    zlib_stream_.avail_in = (uInt)src_size;
+    Deflate(dst, is_last ? Z_FINISH : Z_NO_FLUSH);
+}
+
+void ZlibCompressor::Flush(std::vector<char>& dst)
+{
+    // Full flush also forgets history, so later data doesn't reference earlier.
+    zlib_stream_.next_in = nullptr;
+    zlib_stream_.avail_in = 0;
+    Deflate(dst, Z_FULL_FLUSH);
+}
+
+void ZlibCompressor::Deflate(std::vector<char>& dst, int flush)
+{
+    for(;;)
+    {
+        const size_t dst_offset = dst.size();
+        dst.resize(dst_offset + std::max<size_t>(zlib_stream_.avail_in, 0x1000));
+        zlib_stream_.next_out = (Bytef*)dst.data() + dst_offset;
+        zlib_stream_.avail_out = (uInt)(dst.size() - dst_offset);
+
+        const int zlib_result = deflate(&zlib_stream_, flush);
+        if(zlib_result != Z_OK && zlib_result != Z_STREAM_END && zlib_result != Z_BUF_ERROR)
+            ZlibResultToWcxException(zlib_result);
+        dst.resize(dst.size() - zlib_stream_.avail_out);
+
+        // Output buffer not filled means all input has been consumed.
+        if(flush == Z_FINISH ? zlib_result == Z_STREAM_END : zlib_stream_.avail_out != 0)
+            break;
+    }
+}
+
+class ZlibDecompressor : public Decompressor
+{
+public:
+    ZlibDecompressor(std::span<const char> dictionary, CodecPool* memory_pool);
+    CodecId GetCodec() const override { return kCodecZlib; }
+    void Reset(std::span<const char> dictionary) override;
+    void ResetAtSeekPoint() override;
+    size_t Decompress(const char*& src, size_t& src_size, char* dst, size_t dst_capacity) override;
+    bool IsFinished() const override { return finished_; }
+
+private:
+    z_stream zlib_stream_ = {};
+    std::unique_ptr<z_stream, InflateEndDeleter> zlib_stream_ptr_;
+    std::span<const char> dictionary_;
+    bool finished_ = false;
+};
+
+ZlibDecompressor::ZlibDecompressor(std::span<const char> dictionary, CodecPool* memory_pool) :
+    dictionary_(dictionary)
+{
+    if(memory_pool)
+        memory_pool->SetZlibAllocator(zlib_stream_);
+    const int zlib_result = inflateInit(&zlib_stream_);
+    ZlibResultToWcxException(zlib_result);
+    zlib_stream_ptr_.reset(&zlib_stream_);
+}
+
+void ZlibDecompressor::Reset(std::span<const char> dictionary)
+{
+    // Also restores zlib header after ResetAtSeekPoint.
+    const int zlib_result = inflateReset2(&zlib_stream_, MAX_WBITS);
+    ZlibResultToWcxException(zlib_result);
+    dictionary_ = dictionary;
+    finished_ = false;
+}
+
+void ZlibDecompressor::ResetAtSeekPoint()
+{
+    // Negative window bits - raw deflate, as there is no zlib header in the middle of
+    // the stream. Adler-32 in the trailer is not checked.
+    const int zlib_result = inflateReset2(&zlib_stream_, -MAX_WBITS);
+    ZlibResultToWcxException(zlib_result);
+    dictionary_ = {};
+    finished_ = false;
+}
+
+size_t ZlibDecompressor::Decompress(const char*& src, size_t& src_size, char* dst, size_t dst_capacity)
+{
+    if(finished_)
+        return 0;
+
+    zlib_stream_.next_in = (Bytef*)src;
+    zlib_stream_.avail_in = (uInt)src_size;
+    zlib_stream_.next_out = (Bytef*)dst;
+    zlib_stream_.avail_out = (uInt)dst_capacity;
+
+    int zlib_result = inflate(&zlib_stream_, 0);
+    // Stream compressed with a dictionary asks for it after its header.
+    if(zlib_result == Z_NEED_DICT)
+    {
+        if(dictionary_.empty())
+            throw E_BAD_DATA;
+        // Fails if Adler-32 of the dictionary doesn't match the one in the header.
+        zlib_result = inflateSetDictionary(&zlib_stream_, (const Bytef*)dictionary_.data(), (uInt)dictionary_.size());
+        ZlibResultToWcxException(zlib_result);
+        zlib_result = inflate(&zlib_stream_, 0);
+    }
+    if(zlib_result != Z_OK && zlib_result != Z_STREAM_END)
+        ZlibResultToWcxException(zlib_result);
+    finished_ = zlib_result == Z_STREAM_END;
+
+    src = (const char*)zlib_stream_.next_in;
+    src_size = zlib_stream_.avail_in;
+    return dst_capacity - zlib_stream_.avail_out;
+}
+
+/*
+TrainDictionary is a simplified version of COVER algorithm used by zstd. Samples
+are split into segments. Score of a segment is the sum of frequencies of
+distinct d-mers (substrings of kDictionaryDmerSize bytes) in it, where frequency
+is the number of samples containing the d-mer. Segments are taken greedily,
+highest score first. D-mers of a taken segment no longer count, so the
+dictionary doesn't repeat itself.
+*/
+
+static const size_t kDictionaryDmerSize = 8;
+static const size_t kDictionarySegmentSize = 64;
+
+struct DictionaryDmer
+{
+    uint32_t freq = 0;
+    // Index of the last sample that contained it + 1, so each sample counts once.
+    uint32_t last_sample = 0;
+};
+
+struct DictionarySegment
+{
+    const char* data;
+    size_t size;
+};
+
+std::vector<char> TrainDictionary(std::span<const std::vector<char>> samples, size_t max_size)
+{
+    std::unordered_map<uint64_t, DictionaryDmer> dmers;
+    std::vector<DictionarySegment> segments;
+    for(size_t sample_index = 0; sample_index < samples.size(); ++sample_index)
+    {
+        const std::vector<char>& sample = samples[sample_index];
+        for(size_t pos = 0; pos + kDictionaryDmerSize <= sample.size(); ++pos)
+        {
+            DictionaryDmer& dmer = dmers[LzRead64((const uint8_t*)sample.data() + pos)];
+            if(dmer.last_sample != sample_index + 1)
+            {
+                dmer.last_sample = (uint32_t)sample_index + 1;
+                ++dmer.freq;
+            }
+        }
+        for(size_t pos = 0; pos + kDictionaryDmerSize <= sample.size(); pos += kDictionarySegmentSize)
+            segments.push_back({sample.data() + pos, std::min(kDictionarySegmentSize, sample.size() - pos)});
+    }
+
+    // D-mers occurring in only one sample don't help other data.
+    std::vector<uint64_t> segment_dmers;
+    auto calc_score = [&dmers, &segment_dmers](const DictionarySegment& segment) -> uint64_t
+    {
+        segment_dmers.clear();
+        for(size_t pos = 0; pos + kDictionaryDmerSize <= segment.size; ++pos)
+            segment_dmers.push_back(LzRead64((const uint8_t*)segment.data + pos));
+        std::sort(segment_dmers.begin(), segment_dmers.end());
+        segment_dmers.erase(std::unique(segment_dmers.begin(), segment_dmers.end()), segment_dmers.end());
+
+        uint64_t score = 0;
+        for(uint64_t value : segment_dmers)
+        {
+            const uint32_t freq = dmers[value].freq;
+            if(freq >= 2)
+                score += freq;
+        }
+        return score;
+    };
+
+    // Scores only decrease, so a segment whose recalculated score is still the highest can be taken.
+    std::priority_queue<std::pair<uint64_t, size_t>> queue;
+    for(size_t i = 0; i < segments.size(); ++i)
+    {
+        const uint64_t score = calc_score(segments[i]);
+        if(score > 0)
+            queue.push({score, i});
+    }
+
+    std::vector<size_t> taken;
+    size_t dictionary_size = 0;
+    while(!queue.empty())
+    {
+        const size_t segment_index = queue.top().second;
+        const uint64_t old_score = queue.top().first;
+        queue.pop();
+        const DictionarySegment& segment = segments[segment_index];
+        const uint64_t score = calc_score(segment);
+        if(score == 0)
+            continue;
+        if(score < old_score && !queue.empty() && score < queue.top().first)
+        {
+            queue.push({score, segment_index});
+            continue;
+        }
+        if(dictionary_size + segment.size > max_size)
+            break;
+
+        taken.push_back(segment_index);
+        dictionary_size += segment.size;
+        for(size_t pos = 0; pos + kDictionaryDmerSize <= segment.size; ++pos)
+            dmers[LzRead64((const uint8_t*)segment.data + pos)].freq = 0;
+    }
+
+    std::vector<char> dictionary;
+    dictionary.reserve(dictionary_size);
+    for(size_t i = taken.size(); i--; )
+    {
+        const DictionarySegment& segment = segments[taken[i]];
+        dictionary.insert(dictionary.end(), segment.data, segment.data + segment.size);
+    }
+    return dictionary;
+}
+
+// memory_pool is optional pool for memory of zlib streams.
+static std::unique_ptr<Compressor> NewCompressor(CodecId codec, std::span<const char> dictionary, CodecPool* memory_pool)
+{
+    if(codec != kCodecZlib && !dictionary.empty())
+        throw E_NOT_SUPPORTED;
+
+    switch(codec)
+    {
+    case kCodecZlib:
+        return std::make_unique<ZlibCompressor>(dictionary, memory_pool);
+    case kCodecLz:
+        return std::make_unique<LzCompressor>();
+    default:
+        throw E_UNKNOWN_FORMAT;
+    }
+}
+
+// memory_pool is optional pool for memory of zlib streams.
+static std::unique_ptr<Decompressor> NewDecompressor(CodecId codec, std::span<const char> dictionary, CodecPool* memory_pool)
+{
+    if(codec != kCodecZlib && !dictionary.empty())
+        throw E_NOT_SUPPORTED;
+
+    switch(codec)
+    {
+    case kCodecZlib:
+        return std::make_unique<ZlibDecompressor>(dictionary, memory_pool);
+    case kCodecLz:
+        return std::make_unique<LzDecompressor>();
+    default:
+        throw E_UNKNOWN_FORMAT;
+    }
+}
+
+std::unique_ptr<Compressor> CreateCompressor(CodecId codec, std::span<const char> dictionary)
+{
+    return NewCompressor(codec, dictionary, nullptr);
+}
+
+std::unique_ptr<Decompressor> CreateDecompressor(CodecId codec, std::span<const char> dictionary)
+{
+    return NewDecompressor(codec, dictionary, nullptr);
+}
+
+CodecPool::~CodecPool()
+{
+    // Destroying zlib streams returns their memory to zlib_blocks_.
+    for(auto& compressors : compressors_)
+        compressors.clear();
+    for(auto& decompressors : decompressors_)
+        decompressors.clear();
+    for(const ZlibBlock& block : zlib_blocks_)
+        free((char*)block.ptr - kZlibBlockHeaderSize);
+}
+
+CodecPool::CompressorPtr CodecPool::AcquireCompressor(CodecId codec, std::span<const char> dictionary)
+{
+    if(codec >= kCodecCount)
+        throw E_UNKNOWN_FORMAT;
+
+    std::unique_ptr<Compressor> compressor;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if(!compressors_[codec].empty())
+        {
+            compressor = std::move(compressors_[codec].back());
+            compressors_[codec].pop_back();
+        }
+    }
+    if(compressor)
+        compressor->Reset(dictionary);
+    else
+        compressor = NewCompressor(codec, dictionary, this);
+    return CompressorPtr(compressor.release(), Releaser{this});
+}
+
+CodecPool::DecompressorPtr CodecPool::AcquireDecompressor(CodecId codec, std::span<const char> dictionary)
+{
+    if(codec >= kCodecCount)
+        throw E_UNKNOWN_FORMAT;
+
+    std::unique_ptr<Decompressor> decompressor;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if(!decompressors_[codec].empty())
+        {
+            decompressor = std::move(decompressors_[codec].back());
+            decompressors_[codec].pop_back();
+        }
+    }
+    if(decompressor)
+        decompressor->Reset(dictionary);
+    else
+        decompressor = NewDecompressor(codec, dictionary, this);
+    return DecompressorPtr(decompressor.release(), Releaser{this});
+}
+
+void CodecPool::Release(Compressor* compressor)
+{
+    std::unique_ptr<Compressor> compressor_ptr(compressor);
+    std::lock_guard<std::mutex> lock(mutex_);
+    compressors_[compressor->GetCodec()].push_back(std::move(compressor_ptr));
+}
+
+void CodecPool::Release(Decompressor* decompressor)
+{
+    std::unique_ptr<Decompressor> decompressor_ptr(decompressor);
+    std::lock_guard<std::mutex> lock(mutex_);
+    decompressors_[decompressor->GetCodec()].push_back(std::move(decompressor_ptr));
+}
+
+void CodecPool::SetZlibAllocator(z_stream& zlib_stream)
+{
+    zlib_stream.zalloc = ZlibAlloc;
+    zlib_stream.zfree = ZlibFree;
+    zlib_stream.opaque = this;
+}
+
+void* CodecPool::ZlibAlloc(void* opaque, unsigned item_count, unsigned item_size)
+{
+    CodecPool* const pool = (CodecPool*)opaque;
+    const size_t size = (size_t)item_count * item_size;
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex_);
+        auto it = std::find_if(pool->zlib_blocks_.begin(), pool->zlib_blocks_.end(),
+            [size](const ZlibBlock& block) { return block.size == size; });
+        if(it != pool->zlib_blocks_.end())
+        {
+            void* const ptr = it->ptr;
+            *it = pool->zlib_blocks_.back();
+            pool->zlib_blocks_.pop_back();
+            return ptr;
+        }
+    }
+    char* const ptr = (char*)malloc(kZlibBlockHeaderSize + size);
+    if(!ptr)
+        return Z_NULL;
+    memcpy(ptr, &size, sizeof(size));
+    return ptr + kZlibBlockHeaderSize;
+}
+
+void CodecPool::ZlibFree(void* opaque, void* address)
+{
+    CodecPool* const pool = (CodecPool*)opaque;
+    char* const ptr = (char*)address - kZlibBlockHeaderSize;
+    size_t size;
+    memcpy(&size, ptr, sizeof(size));
+    std::lock_guard<std::mutex> lock(pool->mutex_);
+    pool->zlib_blocks_.push_back({size, address});
+}
+
+void ZlibResultToWcxException(int zlib_result)
+{
+    switch(zlib_result)
+    {
+    case Z_OK:
+        break;
+    case Z_MEM_ERROR:
+        throw E_NO_MEMORY;
+    case Z_STREAM_ERROR:
+        throw E_BAD_ARCHIVE;
+    default:
+        throw E_BAD_DATA;
+    }
+}
+
+void DeflateEndDeleter::operator()(z_stream* s) const
+{
+    deflateEnd(s);
+}
+
+void InflateEndDeleter::operator()(z_stream* s) const
+{
+    inflateEnd(s);
+}
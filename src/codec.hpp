@@ -0,0 +1,161 @@
+/*
+MIT License
+
+Copyright (c) 2025 Adam Sawicki, https://asawicki.info
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+/*
+Compression method of an entry with kEntryFlagCompressed. Stored in extra field
+kExtraFieldCodec. When the field is missing, the entry uses kCodecZlib, which is
+the only codec known by previous versions.
+*/
+enum CodecId : uint8_t
+{
+    // zlib stream (deflate).
+    kCodecZlib = 0,
+    // Byte-oriented LZ77 in the style of LZ4. Lower ratio, but decompresses several
+    // times faster than zlib.
+    kCodecLz = 1,
+    kCodecCount
+};
+
+// Compresses data of one entry as a single stream.
+class Compressor
+{
+public:
+    virtual ~Compressor() = default;
+    virtual CodecId GetCodec() const = 0;
+    // Prepares for compressing a new stream, like a new object created with dictionary.
+    virtual void Reset(std::span<const char> dictionary) = 0;
+    // Compresses src_size bytes of src, appending output to dst. Must be called
+    // with is_last = true for the last part of the data, which may be empty.
+    virtual void Compress(std::vector<char>& dst, const char* src, size_t src_size, bool is_last) = 0;
+    // Appends to dst the rest of output for data passed so far, so decompression can
+    // start at the end of dst with Decompressor::ResetAtSeekPoint, without earlier data.
+    virtual void Flush(std::vector<char>& dst) = 0;
+};
+
+// Decompresses data of one entry produced by a Compressor of the same codec.
+class Decompressor
+{
+public:
+    virtual ~Decompressor() = default;
+    virtual CodecId GetCodec() const = 0;
+    // Prepares for decompressing a new stream, like a new object created with dictionary.
+    virtual void Reset(std::span<const char> dictionary) = 0;
+    // Prepares for decompressing the rest of a stream from a point where its compressor
+    // was flushed. It needs neither earlier data nor the dictionary.
+    virtual void ResetAtSeekPoint() = 0;
+    // Consumes data from src, advancing src and decreasing src_size, and writes up
+    // to dst_capacity bytes to dst. Returns number of bytes written. May need to be
+    // called again with no more input to return remaining output.
+    virtual size_t Decompress(const char*& src, size_t& src_size, char* dst, size_t dst_capacity) = 0;
+    // Returns true when the end of the stream has been reached and all output returned.
+    virtual bool IsFinished() const = 0;
+};
+
+/*
+Throws E_UNKNOWN_FORMAT if codec is not supported. dictionary is preset history
+of the stream, which must be the same for compression and decompression. It is
+supported only by kCodecZlib and must be empty for other codecs. It must stay
+alive as long as the returned object.
+*/
+std::unique_ptr<Compressor> CreateCompressor(CodecId codec, std::span<const char> dictionary = {});
+std::unique_ptr<Decompressor> CreateDecompressor(CodecId codec, std::span<const char> dictionary = {});
+
+/*
+Compressors and decompressors of one archive, reused across its entries, so
+processing many small files doesn't allocate and initialize codec state for each
+of them. zlib streams created by the pool allocate their memory from it, and
+other zlib streams can too, which makes creating them cheap after the first few.
+Thread-safe. Must outlive all objects acquired from it.
+*/
+class CodecPool
+{
+public:
+    // Returns object to the pool on destruction.
+    struct Releaser
+    {
+        CodecPool* pool;
+        void operator()(Compressor* compressor) const { pool->Release(compressor); }
+        void operator()(Decompressor* decompressor) const { pool->Release(decompressor); }
+    };
+    using CompressorPtr = std::unique_ptr<Compressor, Releaser>;
+    using DecompressorPtr = std::unique_ptr<Decompressor, Releaser>;
+
+    CodecPool() = default;
+    ~CodecPool();
+    CodecPool(const CodecPool&) = delete;
+    CodecPool& operator=(const CodecPool&) = delete;
+
+    // Like CreateCompressor, but reuses an object released earlier if possible.
+    CompressorPtr AcquireCompressor(CodecId codec, std::span<const char> dictionary = {});
+    // Like CreateDecompressor, but reuses an object released earlier if possible.
+    DecompressorPtr AcquireDecompressor(CodecId codec, std::span<const char> dictionary = {});
+
+    // Makes zlib_stream allocate its memory from the pool. Call before deflateInit or inflateInit.
+    void SetZlibAllocator(struct z_stream_s& zlib_stream);
+
+private:
+    struct ZlibBlock
+    {
+        size_t size;
+        void* ptr;
+    };
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Compressor>> compressors_[kCodecCount];
+    std::vector<std::unique_ptr<Decompressor>> decompressors_[kCodecCount];
+    // Memory freed by zlib, kept for next streams, which need blocks of the same sizes.
+    std::vector<ZlibBlock> zlib_blocks_;
+
+    void Release(Compressor* compressor);
+    void Release(Decompressor* decompressor);
+    static void* ZlibAlloc(void* opaque, unsigned item_count, unsigned item_size);
+    static void ZlibFree(void* opaque, void* address);
+};
+
+/*
+Builds a dictionary of at most max_size bytes from samples of data, for data
+similar to the samples. It consists of segments of the samples containing
+substrings that occur in the highest number of samples, the most common last,
+where deflate finds them at the shortest distances. Returns empty dictionary if
+samples have nothing in common.
+*/
+std::vector<char> TrainDictionary(std::span<const std::vector<char>> samples, size_t max_size);
+
+// Throws WCX error code appropriate for a zlib error. Does nothing on Z_OK.
+void ZlibResultToWcxException(int zlib_result);
+
+// Deleter for STL smart pointers like std::unique_ptr that calls deflateEnd on
+// destruction.
+struct DeflateEndDeleter
+{
+    void operator()(struct z_stream_s* s) const;
+};
+
+// Deleter for STL smart pointers like std::unique_ptr that calls inflateEnd on
+// destruction.
+struct InflateEndDeleter
+{
+    void operator()(struct z_stream_s* s) const;
+};
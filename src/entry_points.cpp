@@ -52,14 +52,17 @@ int __stdcall GetPackerCaps()
         | PK_CAPS_DELETE
         // Plugin can recognize archive file format by content, not file extension.
         // Function: CanYouHandleThisFIle.
-        | PK_CAPS_BY_CONTENT;
+        | PK_CAPS_BY_CONTENT
+        // Plugin can pack data passed in memory, without temporary files.
+        // Functions: StartMemPack, PackToMem, DoneMemPack.
+        | PK_CAPS_MEMPACK;
 }
 
 extern "C" __declspec(dllexport)
 int __stdcall GetBackgroundFlags()
 {
     // Our packing and unpacking functions are thread-safe.
-    return BACKGROUND_UNPACK | BACKGROUND_PACK;
+    return BACKGROUND_UNPACK | BACKGROUND_PACK | BACKGROUND_MEMPACK;
 }
 
 /*
@@ -159,6 +162,33 @@ int __stdcall ProcessFileW(HANDLE hArcData, int operation, wchar_t *destPath, wc
     }
 }
 
+/*
+Not part of the WCX interface. Can be called instead of ProcessFileW to read a part
+of file that was last met by function ReadHeaderExW without extracting it, or before
+ProcessFileW. Stores up to size bytes of its unpacked data starting at offset in
+buffer and their number in bytesRead, which is less than size only at the end of
+the file. CRC-32 of the file is not checked.
+*/
+extern "C" __declspec(dllexport)
+int __stdcall ReadFileRange(HANDLE hArcData, unsigned long long offset, char* buffer, unsigned int size,
+    unsigned int* bytesRead)
+{
+    auto archive = (ReadingArchive*)hArcData;
+    try
+    {
+        *bytesRead = (unsigned int)archive->ReadFileRange(offset, buffer, size);
+        return 0;
+    }
+    catch(int error_code)
+    {
+        return error_code;
+    }
+    catch(...)
+    {
+        return UNKNOWN_ERROR_CODE;
+    }
+}
+
 extern "C" __declspec(dllexport)
 void __stdcall SetChangeVolProcW(HANDLE hArcData, tChangeVolProcW pChangeVolProc1)
 {
@@ -205,6 +235,70 @@ int __stdcall PackFilesW(wchar_t *packedFile, wchar_t *subPath, wchar_t *srcPath
     }
 }
 
+/*
+These functions pack a single file passed in memory, returning packed data in
+memory. StartMemPack is called first and returns a handle passed to the others.
+FileName is the name of the file, used only when Options contain
+MEM_OPTIONS_WANTHEADERS. There is no Unicode version.
+*/
+extern "C" __declspec(dllexport)
+HANDLE __stdcall StartMemPack(int Options, char* FileName)
+{
+    try
+    {
+        wchar_t file_name[MAX_PATH] = {};
+        if(FileName && !MultiByteToWideChar(CP_ACP, 0, FileName, -1, file_name, MAX_PATH))
+            return nullptr;
+        return (HANDLE)new MemPacker(Options, file_name);
+    }
+    catch(...)
+    {
+        return nullptr;
+    }
+}
+
+/*
+This function is called repeatedly with next parts of data to pack in BufIn and
+InLen, until InLen is 0, which means the end of data. Then it is called until it
+returns MEMPACK_DONE. We never ask the caller to seek in output, so SeekBy is 0.
+*/
+extern "C" __declspec(dllexport)
+int __stdcall PackToMem(HANDLE hMemPack, char* BufIn, int InLen, int* Taken,
+    char* BufOut, int OutLen, int* Written, int* SeekBy)
+{
+    auto packer = (MemPacker*)hMemPack;
+    *Taken = 0;
+    *Written = 0;
+    if(SeekBy)
+        *SeekBy = 0;
+    try
+    {
+        size_t taken = 0;
+        size_t written = 0;
+        const int result = packer->PackToMem(BufIn, (size_t)std::max(InLen, 0), taken,
+            BufOut, (size_t)std::max(OutLen, 0), written);
+        *Taken = (int)taken;
+        *Written = (int)written;
+        return result;
+    }
+    catch(int error_code)
+    {
+        return error_code;
+    }
+    catch(...)
+    {
+        return UNKNOWN_ERROR_CODE;
+    }
+}
+
+extern "C" __declspec(dllexport)
+int __stdcall DoneMemPack(HANDLE hMemPack)
+{
+    auto packer = (MemPacker*)hMemPack;
+    delete packer;
+    return 0;
+}
+
 /*
 This standalone function is called to request deleting a sequence of files and
 directories, enlisted in deleteList parameter, from inside archive indicated by
@@ -28,6 +28,15 @@ SOFTWARE.
 #include <string>
 #include <vector>
 #include <span>
+#include <deque>
+#include <unordered_map>
+#include <map>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
 
 #include <cstdint>
 #include <cassert>
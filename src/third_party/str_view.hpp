@@ -113,7 +113,10 @@ template<typename CharT>
 class str_view_template
 {
 public:
+#ifdef _MSC_VER
+    // Other compilers reject redeclaring a template parameter.
     typedef CharT CharT;
+#endif
     typedef std::basic_string<CharT, std::char_traits<CharT>, std::allocator<CharT>> StringT;
 #if STR_VIEW_CPP17
     typedef std::basic_string_view<CharT, std::char_traits<CharT>> StringViewT;
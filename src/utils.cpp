@@ -25,11 +25,77 @@ SOFTWARE.
 #include "utils.hpp"
 #include <map>
 #include <cctype>
+#include <chrono>
+#include <io.h>
 
-void UpperCase(std::wstring& inout)
+// IoBufferSizer measures this many full buffers before choosing the next size.
+static const size_t kIoBufferSamplesPerSize = 16;
+// Buffer size is doubled again only if that increased throughput at least by this factor.
+static const double kMinIoThroughputGain = 1.1;
+
+// Returns seconds elapsed since start.
+static double SecondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// FNV-1a of lower-case characters, which _wcsicmp compares. Adding characters one by
+// one gives hashes of all prefixes of a path on the way.
+static const uint64_t kPathHashBasis = 0xCBF29CE484222325ull;
+
+static uint64_t HashPathChar(uint64_t hash, wchar_t c)
+{
+    // ASCII is lowered without the call.
+    if(c >= L'A' && c <= L'Z')
+        c += L'a' - L'A';
+    else if(c >= 0x80)
+        c = (wchar_t)towlower(c);
+    hash ^= (uint64_t)c;
+    return hash * 0x100000001B3ull;
+}
+
+size_t HashPathCaseInsensitive(const wstr_view& path)
+{
+    uint64_t hash = kPathHashBasis;
+    for(size_t i = 0, len = path.length(); i < len; ++i)
+        hash = HashPathChar(hash, path[i]);
+    return (size_t)hash;
+}
+
+PathSet::PathSet(std::span<const std::wstring> paths)
+{
+    paths_by_hash_.reserve(paths.size());
+    for(const std::wstring& path : paths)
+        paths_by_hash_.emplace(HashPathCaseInsensitive(path), &path);
+}
+
+const std::wstring* PathSet::Find(const wstr_view& path) const
+{
+    return Find(HashPathCaseInsensitive(path), path.data(), path.length());
+}
+
+bool PathSet::ContainsPathOrParent(const wstr_view& path) const
+{
+    uint64_t hash = kPathHashBasis;
+    for(size_t i = 0, len = path.length(); i < len; ++i)
+    {
+        const wchar_t c = path[i];
+        if((c == L'\\' || c == L'/') && i > 0 && Find((size_t)hash, path.data(), i))
+            return true;
+        hash = HashPathChar(hash, c);
+    }
+    return Find((size_t)hash, path.data(), path.length()) != nullptr;
+}
+
+const std::wstring* PathSet::Find(size_t hash, const wchar_t* path, size_t length) const
 {
-    for(size_t i = 0, len = inout.length(); i < len; ++i)
-        inout[i] = (wchar_t)towupper(inout[i]);
+    auto [begin, end] = paths_by_hash_.equal_range(hash);
+    for(auto it = begin; it != end; ++it)
+    {
+        if(it->second->length() == length && _wcsnicmp(it->second->c_str(), path, length) == 0)
+            return it->second;
+    }
+    return nullptr;
 }
 
 std::wstring CombinePath(const wstr_view& path, const wstr_view& name)
@@ -108,6 +174,340 @@ void UpDir(std::wstring& inout)
         inout.erase(last_slash);
 }
 
+bool MappedFile::Open(FILE* file)
+{
+    Close();
+
+    HANDLE file_handle = (HANDLE)_get_osfhandle(_fileno(file));
+    if(file_handle == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER file_size;
+    if(!GetFileSizeEx(file_handle, &file_size))
+        return false;
+    // Empty file cannot be mapped. File larger than address space neither.
+    if(file_size.QuadPart <= 0 || (uint64_t)file_size.QuadPart > (uint64_t)SIZE_MAX)
+        return false;
+
+    HANDLE mapping_handle = CreateFileMappingW(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if(mapping_handle == NULL)
+        return false;
+    // The view keeps the mapping object alive after its handle is closed.
+    std::unique_ptr<HANDLE, CloseHandleDeleter> mapping(mapping_handle);
+
+    const void* data = MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+    if(data == nullptr)
+        return false;
+
+    data_ = (const char*)data;
+    size_ = (uint64_t)file_size.QuadPart;
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if(data_)
+    {
+        UnmapViewOfFile(data_);
+        data_ = nullptr;
+        size_ = 0;
+    }
+}
+
+ThreadPool::ThreadPool(uint32_t thread_count)
+{
+    if(thread_count == 0)
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    threads_.reserve(thread_count);
+    for(uint32_t i = 0; i < thread_count; ++i)
+        threads_.emplace_back(&ThreadPool::WorkerThread, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    job_available_.notify_all();
+    for(auto& thread : threads_)
+        thread.join();
+}
+
+std::future<void> ThreadPool::Submit(std::function<void()> job)
+{
+    std::packaged_task<void()> task(std::move(job));
+    std::future<void> result = task.get_future();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(std::move(task));
+    }
+    job_available_.notify_one();
+    return result;
+}
+
+void ThreadPool::WorkerThread()
+{
+    for(;;)
+    {
+        std::packaged_task<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            job_available_.wait(lock, [this]() { return stop_ || !jobs_.empty(); });
+            // Remaining jobs are finished before stopping.
+            if(jobs_.empty())
+                return;
+            task = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
+        task();
+    }
+}
+
+std::vector<char> BufferPool::Acquire(size_t size)
+{
+    std::vector<char> buffer;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if(!buffers_.empty())
+        {
+            // Prefer a buffer that doesn't need to grow.
+            auto it = std::find_if(buffers_.rbegin(), buffers_.rend(),
+                [size](const std::vector<char>& b) { return b.capacity() >= size; });
+            if(it == buffers_.rend())
+                it = buffers_.rbegin();
+            buffer = std::move(*it);
+            buffers_.erase(std::next(it).base());
+        }
+    }
+    buffer.resize(size);
+    return buffer;
+}
+
+void BufferPool::Release(std::vector<char>&& buffer)
+{
+    if(buffer.capacity() == 0)
+        return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    buffers_.push_back(std::move(buffer));
+}
+
+IoBufferSizer::IoBufferSizer(size_t min_size, size_t max_size) :
+    max_size_(std::max(min_size, max_size)),
+    size_(min_size)
+{
+    assert(min_size > 0 && (min_size & (min_size - 1)) == 0);
+}
+
+size_t IoBufferSizer::GetBufferSize(uint64_t data_size) const
+{
+    const size_t size = size_;
+    return data_size < size ? std::max<size_t>((size_t)data_size, 1) : size;
+}
+
+void IoBufferSizer::AddSample(size_t buffer_size, double seconds)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if(settled_ || buffer_size != size_)
+        return;
+    sample_seconds_ += seconds;
+    if(++sample_count_ < kIoBufferSamplesPerSize)
+        return;
+
+    // Clock too coarse to tell anything.
+    if(sample_seconds_ <= 0.0)
+        settled_ = true;
+    else
+    {
+        const double throughput = (double)buffer_size * sample_count_ / sample_seconds_;
+        if(prev_throughput_ > 0.0 && throughput < prev_throughput_ * kMinIoThroughputGain)
+        {
+            // Previous size is about as fast and takes less memory.
+            size_ = buffer_size / 2;
+            settled_ = true;
+        }
+        else if(buffer_size * 2 > max_size_)
+            settled_ = true;
+        else
+        {
+            prev_throughput_ = throughput;
+            size_ = buffer_size * 2;
+        }
+    }
+    sample_count_ = 0;
+    sample_seconds_ = 0.0;
+}
+
+ReadAheadFile::ReadAheadFile(UniqueFilePtr&& file, uint64_t expected_size, ThreadPool* thread_pool,
+    BufferPool& buffer_pool, IoBufferSizer& sizer, size_t max_chunk_count) :
+    owned_file_(std::move(file)),
+    file_(owned_file_.get()),
+    bytes_left_(UINT64_MAX),
+    expected_bytes_left_(expected_size),
+    buffer_pool_(buffer_pool),
+    sizer_(sizer),
+    chunks_(max_chunk_count)
+{
+    Start(thread_pool);
+}
+
+ReadAheadFile::ReadAheadFile(FILE* file, uint64_t size, ThreadPool* thread_pool,
+    BufferPool& buffer_pool, IoBufferSizer& sizer, size_t max_chunk_count) :
+    file_(file),
+    bytes_left_(size),
+    expected_bytes_left_(size),
+    buffer_pool_(buffer_pool),
+    sizer_(sizer),
+    chunks_(max_chunk_count)
+{
+    Start(thread_pool);
+}
+
+void ReadAheadFile::Start(ThreadPool* thread_pool)
+{
+    if(!thread_pool)
+        return;
+    done_ = thread_pool->Submit([this]()
+        {
+            try
+            {
+                std::vector<char> chunk;
+                // Push fails when the destructor closed the queue.
+                while(ReadChunk(chunk) && chunks_.Push(std::move(chunk)))
+                {
+                }
+            }
+            catch(...)
+            {
+                chunks_.Close();
+                throw;
+            }
+            chunks_.Close();
+        });
+}
+
+ReadAheadFile::~ReadAheadFile()
+{
+    chunks_.Close();
+    if(done_.valid())
+        done_.wait();
+    buffer_pool_.Release(std::move(chunk_));
+}
+
+std::span<const char> ReadAheadFile::Peek()
+{
+    if(chunk_offset_ == chunk_.size() && !end_)
+    {
+        chunk_offset_ = 0;
+        buffer_pool_.Release(std::move(chunk_));
+        if(!done_.valid())
+            end_ = !ReadChunk(chunk_);
+        else if(!chunks_.Pop(chunk_))
+        {
+            chunk_.clear();
+            end_ = true;
+            // Rethrows read error.
+            done_.get();
+        }
+    }
+    return std::span<const char>(chunk_.data() + chunk_offset_, chunk_.size() - chunk_offset_);
+}
+
+void ReadAheadFile::Skip(size_t size)
+{
+    assert(size <= chunk_.size() - chunk_offset_);
+    chunk_offset_ += size;
+}
+
+size_t ReadAheadFile::Read(void* dst_buf, size_t size)
+{
+    char* dst_ptr = (char*)dst_buf;
+    size_t bytes_read = 0;
+    while(bytes_read < size)
+    {
+        const std::span<const char> data = Peek();
+        if(data.empty())
+            break;
+        const size_t copy_size = std::min(data.size(), size - bytes_read);
+        memcpy(dst_ptr + bytes_read, data.data(), copy_size);
+        Skip(copy_size);
+        bytes_read += copy_size;
+    }
+    return bytes_read;
+}
+
+bool ReadAheadFile::ReadChunk(std::vector<char>& out_chunk)
+{
+    // Once the expected data is read, the end of file is confirmed by reading 1 byte.
+    const size_t chunk_size = (size_t)std::min<uint64_t>(sizer_.GetBufferSize(expected_bytes_left_), bytes_left_);
+    out_chunk = buffer_pool_.Acquire(chunk_size);
+    const auto start_time = std::chrono::steady_clock::now();
+    const size_t size = fread(out_chunk.data(), 1, chunk_size, file_);
+    if(size < chunk_size && !feof(file_))
+        throw E_EREAD;
+    if(size == chunk_size)
+        sizer_.AddSample(size, SecondsSince(start_time));
+    out_chunk.resize(size);
+    bytes_left_ -= size;
+    expected_bytes_left_ = size <= expected_bytes_left_ ? expected_bytes_left_ - size : UINT64_MAX;
+    return size > 0;
+}
+
+WriteBehindFile::WriteBehindFile(FILE* file, ThreadPool* thread_pool, BufferPool& buffer_pool, IoBufferSizer& sizer,
+    size_t max_pending_count) :
+    file_(file),
+    buffer_pool_(buffer_pool),
+    sizer_(sizer),
+    buffers_(max_pending_count)
+{
+    if(!thread_pool)
+        return;
+    done_ = thread_pool->Submit([this]()
+        {
+            try
+            {
+                std::vector<char> data;
+                while(buffers_.Pop(data))
+                    WriteBuffer(std::move(data));
+            }
+            catch(...)
+            {
+                buffers_.Close();
+                throw;
+            }
+        });
+}
+
+WriteBehindFile::~WriteBehindFile()
+{
+    buffers_.Close();
+    if(done_.valid())
+        done_.wait();
+}
+
+void WriteBehindFile::Write(std::vector<char>&& data)
+{
+    if(!done_.valid())
+        WriteBuffer(std::move(data));
+    // Queue is closed only when the job failed.
+    else if(!buffers_.Push(std::move(data)))
+        done_.get();
+}
+
+void WriteBehindFile::Finish()
+{
+    buffers_.Close();
+    if(done_.valid())
+        done_.get();
+}
+
+void WriteBehindFile::WriteBuffer(std::vector<char>&& data)
+{
+    const auto start_time = std::chrono::steady_clock::now();
+    WriteOrThrow(data.data(), 1, data.size(), file_);
+    sizer_.AddSample(data.size(), SecondsSince(start_time));
+    buffer_pool_.Release(std::move(data));
+}
+
 void ReadOrThrow(void* dst_buf, size_t elem_size, size_t elem_count, FILE* file)
 {
     size_t elements_read = fread(dst_buf, elem_size, elem_count, file);
@@ -127,3 +527,21 @@ void SeekOrThrow(FILE* stream, int64_t offset, int origin)
     if(_fseeki64(stream, offset, origin) != 0)
         throw E_NOT_SUPPORTED;
 }
+
+void TruncateOrThrow(FILE* stream, uint64_t size)
+{
+    if(fflush(stream) != 0)
+        throw E_EWRITE;
+    if(_chsize_s(_fileno(stream), (long long)size) != 0)
+        throw E_EWRITE;
+}
+
+void PreallocateFile(FILE* stream, uint64_t size)
+{
+    const HANDLE handle = (HANDLE)_get_osfhandle(_fileno(stream));
+    if(handle == INVALID_HANDLE_VALUE)
+        return;
+    FILE_ALLOCATION_INFO allocation_info = {};
+    allocation_info.AllocationSize.QuadPart = (LONGLONG)size;
+    ::SetFileInformationByHandle(handle, FileAllocationInfo, &allocation_info, sizeof(allocation_info));
+}
@@ -64,6 +64,245 @@ struct CloseHandleDeleter
     }
 };
 
+/*
+Read-only memory mapping of a whole file. When mapping fails, e.g. for an empty
+file or when address space is too small, the object stays empty, so caller can
+fall back to regular file I/O.
+*/
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile() { Close(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Maps file opened for reading. Returns false on failure.
+    bool Open(FILE* file);
+    void Close();
+    bool IsOpen() const { return data_ != nullptr; }
+    const char* GetData() const { return data_; }
+    uint64_t GetSize() const { return size_; }
+
+private:
+    const char* data_ = nullptr;
+    uint64_t size_ = 0;
+};
+
+/*
+Pool of worker threads executing jobs in FIFO order. Exception thrown by a job,
+e.g. one of E_* error codes, is passed to the caller through returned future.
+Destructor waits for all submitted jobs to finish.
+*/
+class ThreadPool
+{
+public:
+    // thread_count == 0 means number of hardware threads.
+    explicit ThreadPool(uint32_t thread_count = 0);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    uint32_t GetThreadCount() const { return (uint32_t)threads_.size(); }
+    std::future<void> Submit(std::function<void()> job);
+
+private:
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable job_available_;
+    std::deque<std::packaged_task<void()>> jobs_;
+    bool stop_ = false;
+
+    void WorkerThread();
+};
+
+/*
+Queue of at most capacity items passed between threads. Push waits while it is
+full, Pop waits while it is empty. After Close, Push fails and Pop returns the
+remaining items, then fails.
+*/
+template<typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : capacity_(capacity) { assert(capacity > 0); }
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    // Returns false if the queue is closed.
+    bool Push(T&& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this]() { return closed_ || items_.size() < capacity_; });
+        if(closed_)
+            return false;
+        items_.push_back(std::move(item));
+        lock.unlock();
+        not_empty_.notify_one();
+        return true;
+    }
+    // Returns false if the queue is closed and empty.
+    bool Pop(T& out_item)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this]() { return closed_ || !items_.empty(); });
+        if(items_.empty())
+            return false;
+        out_item = std::move(items_.front());
+        items_.pop_front();
+        lock.unlock();
+        not_full_.notify_one();
+        return true;
+    }
+    void Close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+private:
+    const size_t capacity_;
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    std::deque<T> items_;
+    bool closed_ = false;
+};
+
+/*
+Byte buffers kept for reuse, so code processing data in chunks doesn't allocate
+and zero a new buffer for each chunk. Thread-safe.
+*/
+class BufferPool
+{
+public:
+    // Returns buffer of size bytes, reusing a released one if possible. Its content
+    // is undefined.
+    std::vector<char> Acquire(size_t size);
+    void Release(std::vector<char>&& buffer);
+
+private:
+    std::mutex mutex_;
+    std::vector<std::vector<char>> buffers_;
+};
+
+/*
+Chooses size of buffers used to read and write entry data: a power of 2 from
+min_size to max_size, where max_size comes from a memory limit. Starting from
+min_size, the size is doubled while measured throughput of full buffers grows by
+a noticeable amount, which happens when per-request overhead dominates, like on
+a network share, and then stays at the last size that helped. Data smaller than
+the buffer gets buffer of its own size. Thread-safe.
+*/
+class IoBufferSizer
+{
+public:
+    IoBufferSizer(size_t min_size, size_t max_size);
+
+    // Returns buffer size for data of data_size bytes.
+    size_t GetBufferSize(uint64_t data_size) const;
+    // Reports that full buffer of buffer_size bytes was read or written in
+    // seconds. Ignored if buffer_size is not the current size.
+    void AddSample(size_t buffer_size, double seconds);
+
+private:
+    const size_t max_size_;
+    std::atomic<size_t> size_;
+    std::mutex mutex_;
+    // Measured since size_ last changed.
+    size_t sample_count_ = 0;
+    double sample_seconds_ = 0.0;
+    // Bytes per second with previous size_, 0 if none.
+    double prev_throughput_ = 0.0;
+    bool settled_ = false;
+};
+
+/*
+Sequential reader of a file, which reads up to max_chunk_count chunks ahead by a
+job on thread_pool, so the data is already in memory when the caller needs it.
+With thread_pool == nullptr, it reads synchronously. Read error is thrown by the
+call that reaches the failed chunk. Chunks come from buffer_pool and return there
+when consumed. Each chunk is sized by sizer, which also gets the times of
+reading them.
+*/
+class ReadAheadFile
+{
+public:
+    // Reads from the current position of file to its end. expected_size is used
+    // to size chunks, so a small file doesn't take a large buffer.
+    ReadAheadFile(UniqueFilePtr&& file, uint64_t expected_size, ThreadPool* thread_pool,
+        BufferPool& buffer_pool, IoBufferSizer& sizer, size_t max_chunk_count);
+    // Reads at most size bytes from the current position of file, which is not owned
+    // and must not be used by anyone else until this object is destroyed.
+    ReadAheadFile(FILE* file, uint64_t size, ThreadPool* thread_pool,
+        BufferPool& buffer_pool, IoBufferSizer& sizer, size_t max_chunk_count);
+    // Stops reading ahead and waits for the job.
+    ~ReadAheadFile();
+    ReadAheadFile(const ReadAheadFile&) = delete;
+    ReadAheadFile& operator=(const ReadAheadFile&) = delete;
+
+    // Returns next data without consuming it: the rest of the current chunk or the
+    // whole next chunk. Returns empty span at the end of file.
+    std::span<const char> Peek();
+    // Consumes size bytes, at most as many as returned by Peek.
+    void Skip(size_t size);
+    // Like fread(), returns less than size only at the end of file.
+    size_t Read(void* dst_buf, size_t size);
+
+private:
+    UniqueFilePtr owned_file_;
+    FILE* const file_;
+    uint64_t bytes_left_;
+    // UINT64_MAX when the file turned out larger than expected.
+    uint64_t expected_bytes_left_;
+    BufferPool& buffer_pool_;
+    IoBufferSizer& sizer_;
+    BoundedQueue<std::vector<char>> chunks_;
+    std::future<void> done_;
+    std::vector<char> chunk_;
+    size_t chunk_offset_ = 0;
+    bool end_ = false;
+
+    void Start(ThreadPool* thread_pool);
+    // Reads next chunk from file_. Returns false at the end of file.
+    bool ReadChunk(std::vector<char>& out_chunk);
+};
+
+/*
+Sequential writer to a file, which writes by a job on thread_pool, so the caller
+can prepare next data meanwhile. At most max_pending_count buffers wait for
+writing. With thread_pool == nullptr, it writes synchronously. Write error is
+thrown by next Write or by Finish. Written buffers are released to buffer_pool.
+Times of writing them are reported to sizer.
+*/
+class WriteBehindFile
+{
+public:
+    WriteBehindFile(FILE* file, ThreadPool* thread_pool, BufferPool& buffer_pool, IoBufferSizer& sizer,
+        size_t max_pending_count);
+    // Waits for the job. Call Finish to know that all data was written.
+    ~WriteBehindFile();
+    WriteBehindFile(const WriteBehindFile&) = delete;
+    WriteBehindFile& operator=(const WriteBehindFile&) = delete;
+
+    void Write(std::vector<char>&& data);
+    // Waits until all data is written.
+    void Finish();
+
+private:
+    FILE* const file_;
+    BufferPool& buffer_pool_;
+    IoBufferSizer& sizer_;
+    BoundedQueue<std::vector<char>> buffers_;
+    std::future<void> done_;
+
+    void WriteBuffer(std::vector<char>&& data);
+};
+
 /*
 Predicate functor to compare two std::wstring-s if first one is less
 lexiconographically, case-insensitive.
@@ -77,9 +316,33 @@ struct StricmpPred
 };
 
 /*
-Converts inout string to upper-case, in place.
+Returns hash of path consistent with _wcsicmp: paths that differ only in case have
+equal hashes.
 */
-void UpperCase(std::wstring& inout);
+size_t HashPathCaseInsensitive(const wstr_view& path);
+
+/*
+Set of paths, compared case-insensitive like _wcsicmp. Tells whether a path or one of
+its parent directories is in the set in time linear in length of the path, without
+allocating memory. Paths passed to the constructor must outlive the set.
+*/
+class PathSet
+{
+public:
+    explicit PathSet(std::span<const std::wstring> paths);
+
+    // Returns the path passed to the constructor that is equal to path, or null.
+    const std::wstring* Find(const wstr_view& path) const;
+    bool Contains(const wstr_view& path) const { return Find(path) != nullptr; }
+    // Returns true if path or one of its parent directories is in the set.
+    bool ContainsPathOrParent(const wstr_view& path) const;
+
+private:
+    // Key is HashPathCaseInsensitive of the path.
+    std::unordered_multimap<size_t, const std::wstring*> paths_by_hash_;
+
+    const std::wstring* Find(size_t hash, const wchar_t* path, size_t length) const;
+};
 
 /*
 Combines absolute or relative directory name "path" with relative path or file
@@ -132,3 +395,9 @@ void ReadOrThrow(void* dst_buf, size_t elem_size, size_t elem_count, FILE* file)
 void WriteOrThrow(const void* buf, size_t elem_size, size_t elem_count, FILE* file);
 // Calls fseek(). On error, throws exception.
 void SeekOrThrow(FILE* stream, int64_t offset, int origin);
+// Flushes the stream and sets file size. On error, throws exception.
+void TruncateOrThrow(FILE* stream, uint64_t size);
+// Reserves disk space for the file to grow to size bytes, so it gets fewer and larger
+// extents. File size doesn't change, and unused space is released when the file is
+// closed. On failure does nothing, not throwing exception.
+void PreallocateFile(FILE* stream, uint64_t size);